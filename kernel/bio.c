@@ -21,25 +21,100 @@
 #include "defs.h"
 #include "fs.h"
 #include "buf.h"
+#include "virtio.h"
 
-#define NBUCKETS 53
+#define NBUCKETMAX 61 // bounds the per-lock lines in the statistics output
+#define BGROW 2       // the cache may grow to BGROW times its boot size
+#define BPP (PGSIZE / BSIZE) // buffers sharing one data page
+
+// Initial number of buffers. There are no boot arguments, so it is
+// set at build time: make NBUF=n.
+int nbuf = NBUF;
+int nbufmax; // nbuf * BGROW, set by binit()
+
+// Blocks readi() reads ahead of a sequential reader. 0 turns
+// read-ahead off; readi() keeps it below a quarter of the cache.
+int rawindow = RAWINDOW;
 
 struct
 {
   // assign a lock to every bucket
-  struct spinlock lock[NBUCKETS];
-  struct buf buf[NBUF];
+  struct spinlock lock[NBUCKETMAX];
+  int nbucket;
+
+  // Buffer headers, allocated at boot for the largest size the cache
+  // can grow to. Only buf[0..n-1] are in use; they are added and
+  // removed BPP at a time, together with the page holding their data.
+  // Headers are never freed, so lock-free readers can't touch freed
+  // memory. A removed buffer keeps refcnt 1 and is on no chain.
+  struct buf *buf;
+  int n;
+  struct spinlock growlock; // serializes bgrow() and bshrink()
 
-  // Linked list of all buffers, through prev/next.
-  // Sorted by how recently the buffer was used.
-  // head.next is most recent, head.prev is least.
-  struct buf head[NBUCKETS];
+  // Hash chains of buffers, through prev/next, one per bucket.
+  // A buffer is on the chain of getIndex(b->blockno) and only
+  // moves to another chain with both bucket locks held.
+  struct buf head[NBUCKETMAX];
+
+  // per-bucket counters, protected by the bucket lock
+  int nhit[NBUCKETMAX];
+  int nmiss[NBUCKETMAX];
+  int nretry[NBUCKETMAX]; // victim changed before we locked it
+  int ngrow;
+  int nshrink;
+
+  // read-ahead counters
+  int raissued; // blocks bprefetch() started reading
+  int rahit;    // of those, read by bread() afterwards
+  int rawasted; // evicted before anybody read them
 } bcache;
 
+// LRU clock. brelse() stamps a buffer with the next value when its
+// last reference goes away, so the unused buffer with the smallest
+// timeStamp is the least recently used one.
+static uint bticks;
+
+static int bgrow(void);
+static int bcache_reclaim(int);
+static void bput(struct buf *);
+
+static int
+isprime(int n)
+{
+  for (int d = 2; d * d <= n; d++)
+    if (n % d == 0)
+      return 0;
+  return n > 1;
+}
+
 void binit(void)
 {
-  struct buf *b;
-  for (int i = 0; i < NBUCKETS; ++i) // initialize all the locks
+  int order = 0;
+
+  if (nbuf < BPP)
+    nbuf = BPP;
+  nbuf = (nbuf + BPP - 1) / BPP * BPP;
+  nbufmax = nbuf * BGROW;
+  while ((PGSIZE << order) < nbufmax * sizeof(struct buf))
+    order++;
+  if ((bcache.buf = kalloc_pages(order)) == 0)
+    panic("binit");
+
+  // about two buckets per buffer, with a prime modulus.
+  bcache.nbucket = 2 * nbuf;
+  while (!isprime(bcache.nbucket))
+    bcache.nbucket++;
+  if (bcache.nbucket > NBUCKETMAX)
+    bcache.nbucket = NBUCKETMAX;
+
+  // once, for every header bgrow() may ever use: headers that
+  // bshrink() gives back are reused, and each initlock() takes a
+  // lock statistics slot of its own.
+  for (int i = 0; i < nbufmax; i++)
+    initsleeplock(&bcache.buf[i].lock, "buffer");
+
+  initlock(&bcache.growlock, "bgrow");
+  for (int i = 0; i < bcache.nbucket; ++i) // initialize all the locks
   {
     initlock(&bcache.lock[i], "bcache");
     // Create linked list of buffers
@@ -47,93 +122,395 @@ void binit(void)
     bcache.head[i].next = &bcache.head[i];
   }
 
-  for (b = bcache.buf; b < bcache.buf + NBUF; b++)
+  while (bcache.n < nbuf)
+    if (bgrow() == 0)
+      panic("binit: no memory");
+  bcache.ngrow = 0;
+  kreclaim_register(bcache_reclaim);
+}
+
+// This is the hash function
+unsigned char getIndex(uint blockno)
+{
+  return blockno % bcache.nbucket;
+}
+
+// Add BPP buffers sharing a new data page to the cache.
+// Returns 0 if the cache is at its maximum size or memory is short.
+static int
+bgrow(void)
+{
+  struct buf *b;
+  char *data;
+
+  if ((data = kalloc()) == 0)
+    return 0;
+
+  acquire(&bcache.growlock);
+  if (bcache.n + BPP > nbufmax)
   {
+    release(&bcache.growlock);
+    kfree(data);
+    return 0;
+  }
+  acquire(&bcache.lock[0]);
+  for (b = bcache.buf + bcache.n; b < bcache.buf + bcache.n + BPP; b++)
+  {
+    b->data = (uchar *)data + (b - bcache.buf) % BPP * BSIZE;
+    b->dev = 0;
+    b->blockno = 0;
+    b->valid = 0;
+    b->refcnt = 0;
+    b->timeStamp = 0;
+    b->iodone = 0;
     b->next = bcache.head[0].next;
     b->prev = &bcache.head[0];
-    initsleeplock(&b->lock, "buffer");
     bcache.head[0].next->prev = b;
     bcache.head[0].next = b;
   }
+  release(&bcache.lock[0]);
+  __atomic_store_n(&bcache.n, bcache.n + BPP, __ATOMIC_RELEASE);
+  bcache.ngrow++;
+  release(&bcache.growlock);
+  return 1;
 }
 
-// This is the hash function
-unsigned char getIndex(uint blockno)
+// Take b out of the cache if it is unused: unlink it from its
+// chain and leave refcnt at 1 so nobody picks it.
+static int
+bclaim(struct buf *b)
 {
-  return blockno % NBUCKETS;
+  unsigned char idx = getIndex(b->blockno);
+  int ok = 0;
+
+  acquire(&bcache.lock[idx]);
+  if (b->refcnt == 0 && getIndex(b->blockno) == idx)
+  {
+    b->next->prev = b->prev;
+    b->prev->next = b->next;
+    b->refcnt = 1;
+    b->valid = 0;
+    ok = 1;
+  }
+  release(&bcache.lock[idx]);
+  return ok;
+}
+
+// Put a buffer that bclaim() took back on bucket 0, unused.
+static void
+bunclaim(struct buf *b)
+{
+  acquire(&bcache.lock[0]);
+  b->dev = 0;
+  b->blockno = 0;
+  b->refcnt = 0;
+  b->next = bcache.head[0].next;
+  b->prev = &bcache.head[0];
+  bcache.head[0].next->prev = b;
+  bcache.head[0].next = b;
+  release(&bcache.lock[0]);
+}
+
+// Remove the last BPP buffers and free their data page, if none
+// of them is in use and the cache is above its boot size.
+static int
+bshrink(void)
+{
+  struct buf *first;
+  int i;
+
+  acquire(&bcache.growlock);
+  if (bcache.n <= nbuf)
+  {
+    release(&bcache.growlock);
+    return 0;
+  }
+  first = bcache.buf + bcache.n - BPP;
+  for (i = 0; i < BPP; i++)
+    if (!bclaim(first + i))
+      break;
+  if (i < BPP)
+  {
+    while (i-- > 0)
+      bunclaim(first + i);
+    release(&bcache.growlock);
+    return 0;
+  }
+  __atomic_store_n(&bcache.n, bcache.n - BPP, __ATOMIC_RELEASE);
+  bcache.nshrink++;
+  release(&bcache.growlock);
+  kfree(first->data);
+  return 1;
+}
+
+// Called by kalloc() under memory pressure: shrink the cache back
+// towards its boot size, up to n pages.
+static int
+bcache_reclaim(int n)
+{
+  int got = 0;
+
+  while (got < n && bshrink())
+    got++;
+  return got;
+}
+
+// Look for the block in bucket idx, whose lock must be held.
+static struct buf *
+bfind(unsigned char idx, uint dev, uint blockno)
+{
+  struct buf *b;
+
+  for (b = bcache.head[idx].next; b != &bcache.head[idx]; b = b->next)
+    if (b->dev == dev && b->blockno == blockno)
+      return b;
+  return 0;
+}
+
+// Find the least recently used buffer with no references, without
+// taking any lock. The answer can be stale by the time the caller
+// locks the buffer's bucket, so it has to check again.
+static struct buf *
+blru(void)
+{
+  struct buf *b, *victim = 0;
+  uint oldest = 0;
+  int n = __atomic_load_n(&bcache.n, __ATOMIC_ACQUIRE);
+
+  for (b = bcache.buf; b < bcache.buf + n; b++)
+  {
+    if (__atomic_load_n(&b->refcnt, __ATOMIC_RELAXED) != 0)
+      continue;
+    if (!b->valid)
+      return b; // empty, nothing to evict
+    uint t = __atomic_load_n(&b->timeStamp, __ATOMIC_RELAXED);
+    if (victim == 0 || (int)(t - oldest) < 0)
+    {
+      victim = b;
+      oldest = t;
+    }
+  }
+  return victim;
+}
+
+// Lock buckets a and b, lower index first so two CPUs locking
+// the same pair can't deadlock.
+static void
+block2(unsigned char a, unsigned char b)
+{
+  if (a > b)
+  {
+    unsigned char t = a;
+    a = b;
+    b = t;
+  }
+  acquire(&bcache.lock[a]);
+  if (b != a)
+    acquire(&bcache.lock[b]);
+}
+
+static void
+bunlock2(unsigned char a, unsigned char b)
+{
+  if (b != a)
+    release(&bcache.lock[b]);
+  release(&bcache.lock[a]);
 }
 
 // Look through buffer cache for block on device dev.
 // If not found, allocate a buffer.
 // In either case, return locked buffer.
+// With prefetch set, return 0 instead if the block is cached.
 static struct buf *
-bget(uint dev, uint blockno)
+bget(uint dev, uint blockno, int prefetch)
 {
   struct buf *b;
   unsigned char idx = getIndex(blockno);
+  unsigned char vidx;
 
   acquire(&bcache.lock[idx]);
 
   // Is the block already cached?
-  for (b = bcache.head[idx].next; b != &bcache.head[idx]; b = b->next)
+  if ((b = bfind(idx, dev, blockno)) != 0)
   {
-    if (b->dev == dev && b->blockno == blockno)
+    if (prefetch)
     {
-      b->refcnt++;
       release(&bcache.lock[idx]);
-      acquiresleep(&b->lock);
-      return b;
+      return 0;
     }
+    b->refcnt++;
+    bcache.nhit[idx]++;
+    release(&bcache.lock[idx]);
+    acquiresleep(&b->lock);
+    return b;
   }
+  release(&bcache.lock[idx]);
 
-  // Not cached.
-  // Recycle the next unused buffer because I'm lazy and it is final
-  unsigned char nextIdx = getIndex(blockno + 1);
-  while (nextIdx != idx)
+  // Not cached. Grow the cache while memory is plentiful, so large
+  // working sets stop evicting each other.
+  if (bcache.n < nbufmax && kfreecount() > 2 * kmem_high)
+    bgrow();
+
+  // Pick the LRU victim without locks, then lock its bucket
+  // and ours and make sure nothing changed in between.
+  for (;;)
   {
-    acquire(&bcache.lock[nextIdx]);
-    for (b = bcache.head[nextIdx].prev; b != &bcache.head[nextIdx]; b = b->prev)
+    if ((b = blru()) == 0)
+    {
+      // every buffer is in use; grow even if memory is short.
+      if (bgrow())
+        continue;
+      panic("bget: no buffers");
+    }
+    vidx = getIndex(b->blockno);
+    block2(idx, vidx);
+
+    // Did another process cache the block while we were unlocked?
+    struct buf *c = bfind(idx, dev, blockno);
+    if (c != 0)
     {
-      if (b->refcnt == 0)
+      if (prefetch)
       {
-        b->dev = dev;
-        b->blockno = blockno;
-        b->valid = 0;
-        b->refcnt = 1;
-        b->next->prev = b->prev;
-        b->prev->next = b->next;
-        release(&bcache.lock[nextIdx]);
-        b->next = bcache.head[idx].next;
-        b->prev = &bcache.head[idx];
-        bcache.head[idx].next->prev = b;
-        bcache.head[idx].next = b;
-
-        release(&bcache.lock[idx]);
-        acquiresleep(&b->lock);
-        return b;
+        bunlock2(idx, vidx);
+        return 0;
       }
+      c->refcnt++;
+      bcache.nhit[idx]++;
+      bunlock2(idx, vidx);
+      acquiresleep(&c->lock);
+      return c;
     }
-    release(&bcache.lock[nextIdx]);
-    nextIdx = getIndex(nextIdx + 1);
+
+    if (b->refcnt == 0 && getIndex(b->blockno) == vidx)
+      break;
+    bcache.nretry[idx]++;
+    bunlock2(idx, vidx);
   }
-  panic("bget: no buffers");
-}
 
+  if (b->ra)
+  {
+    // read ahead but never used
+    __atomic_fetch_add(&bcache.rawasted, 1, __ATOMIC_RELAXED);
+    b->ra = 0;
+  }
+  b->dev = dev;
+  b->blockno = blockno;
+  b->valid = 0;
+  b->refcnt = 1;
+  if (vidx != idx)
+  {
+    b->next->prev = b->prev;
+    b->prev->next = b->next;
+    b->next = bcache.head[idx].next;
+    b->prev = &bcache.head[idx];
+    bcache.head[idx].next->prev = b;
+    bcache.head[idx].next = b;
+  }
+  bcache.nmiss[idx]++;
+  bunlock2(idx, vidx);
+  acquiresleep(&b->lock);
+  return b;
+}
 // Return a locked buf with the contents of the indicated block.
 struct buf *
 bread(uint dev, uint blockno)
 {
   struct buf *b;
 
-  b = bget(dev, blockno);
+  b = bget(dev, blockno, 0);
   if (!b->valid)
   {
     virtio_disk_rw(b, 0);
     b->valid = 1;
   }
+  else if (b->ra)
+  {
+    __atomic_fetch_add(&bcache.rahit, 1, __ATOMIC_RELAXED);
+    b->ra = 0;
+  }
   return b;
 }
 
+// Hand n locked bufs to the disk, one request per run of
+// consecutive blocks. Sorts bs by block number to find the runs.
+static void
+bsubmit(struct buf **bs, int n, int write)
+{
+  struct buf *t;
+  int i, j, run;
+
+  for (i = 1; i < n; i++)
+  {
+    t = bs[i];
+    for (j = i; j > 0 && bs[j - 1]->blockno > t->blockno; j--)
+      bs[j] = bs[j - 1];
+    bs[j] = t;
+  }
+
+  for (i = 0; i < n; i += run)
+  {
+    run = 1;
+    while (i + run < n && run < VSEGMAX &&
+           bs[i + run]->blockno == bs[i]->blockno + run)
+      run++;
+    virtio_disk_submitv(bs + i, run, write);
+  }
+}
+
+// Return a locked buf for the indicated block without reading it
+// from disk, for a caller that is about to overwrite all of it.
+struct buf *
+bgrab(uint dev, uint blockno)
+{
+  struct buf *b;
+
+  b = bget(dev, blockno, 0);
+  b->valid = 1;
+  return b;
+}
+
+// Start reading n blocks that are likely to be needed soon into
+// the cache, without waiting for the disk. Blocks that are already
+// cached are skipped, so this never sleeps waiting for a buffer.
+// Consecutive blocks are read with one disk request.
+void bprefetch(uint dev, uint *blocknos, int n)
+{
+  struct buf *bs[VSEGMAX];
+  struct buf *b;
+  int nb = 0;
+
+  for (int i = 0; i < n; i++)
+  {
+    if ((b = bget(dev, blocknos[i], 1)) == 0)
+      continue;
+    b->ra = 1;
+    b->iodone = bdone;
+    bs[nb++] = b;
+    __atomic_fetch_add(&bcache.raissued, 1, __ATOMIC_RELAXED);
+    if (nb == VSEGMAX)
+    {
+      bsubmit(bs, nb, 0);
+      nb = 0;
+    }
+  }
+  if (nb > 0)
+    bsubmit(bs, nb, 0);
+}
+
+// Called by virtio_disk_intr() when a read started by bprefetch()
+// completes: unlock and release the buffer on its owner's behalf.
+void bdone(struct buf *b)
+{
+  b->iodone = 0;
+  b->valid = 1;
+  releasesleep(&b->lock);
+
+  unsigned char idx = getIndex(b->blockno);
+  acquire(&bcache.lock[idx]);
+  bput(b);
+  release(&bcache.lock[idx]);
+}
+
 // Write b's contents to disk.  Must be locked.
 void bwrite(struct buf *b)
 {
@@ -142,8 +519,37 @@ void bwrite(struct buf *b)
   virtio_disk_rw(b, 1);
 }
 
+// Start writing the contents of n bufs to disk without waiting, so
+// that several writes can be in flight. Runs of consecutive blocks
+// go to the disk as one request; bs is sorted by block number to
+// find them. The bufs must be locked, and must stay locked until
+// bwrite_wait() returns for each of them.
+void bwrite_start(struct buf **bs, int n)
+{
+  for (int i = 0; i < n; i++)
+    if (!holdingsleep(&bs[i]->lock))
+      panic("bwrite_start");
+  bsubmit(bs, n, 1);
+}
+
+// Wait for the write bwrite_start() started on b.
+void bwrite_wait(struct buf *b)
+{
+  virtio_disk_wait(b);
+}
+
+// Drop a reference to b, whose bucket lock is held. The last
+// one stamps b as the most recently used buffer.
+static void
+bput(struct buf *b)
+{
+  b->refcnt--;
+  if (b->refcnt == 0)
+    b->timeStamp = __atomic_add_fetch(&bticks, 1, __ATOMIC_RELAXED);
+}
+
 // Release a locked buffer.
-// Move to the head of the most-recently-used list.
+// Mark it as the most recently used one.
 void brelse(struct buf *b)
 {
   if (!holdingsleep(&b->lock))
@@ -153,18 +559,7 @@ void brelse(struct buf *b)
 
   unsigned char idx = getIndex(b->blockno);
   acquire(&bcache.lock[idx]);
-  b->refcnt--;
-  if (b->refcnt == 0)
-  {
-    // no one is waiting for it.
-    b->next->prev = b->prev;
-    b->prev->next = b->next;
-    b->next = bcache.head[idx].next;
-    b->prev = &bcache.head[idx];
-    bcache.head[idx].next->prev = b;
-    bcache.head[idx].next = b;
-  }
-
+  bput(b);
   release(&bcache.lock[idx]);
 }
 
@@ -180,6 +575,27 @@ void bunpin(struct buf *b)
 {
   unsigned char idx = getIndex(b->blockno);
   acquire(&bcache.lock[idx]);
-  b->refcnt--;
+  bput(b);
   release(&bcache.lock[idx]);
 }
+
+#ifdef LAB_LOCK
+// Buffer cache counters for the statistics device.
+int statsbcache(char *buf, int sz)
+{
+  int hit = 0, miss = 0, retry = 0;
+
+  for (int i = 0; i < bcache.nbucket; i++)
+  {
+    hit += bcache.nhit[i];
+    miss += bcache.nmiss[i];
+    retry += bcache.nretry[i];
+  }
+  int n = snprintf(buf, sz, "bcache: %d buffers (boot %d max %d) %d buckets #hit %d #miss %d #retry %d #grow %d #shrink %d\n",
+                   bcache.n, nbuf, nbufmax, bcache.nbucket, hit, miss, retry,
+                   bcache.ngrow, bcache.nshrink);
+  n += snprintf(buf + n, sz - n, "bcache: readahead window %d #issued %d #hit %d #wasted %d\n",
+                rawindow, bcache.raissued, bcache.rahit, bcache.rawasted);
+  return n;
+}
+#endif
@@ -0,0 +1,375 @@
+// Buddy allocator for physically contiguous memory.
+//
+// The top BUDDYPAGES pages of RAM are set aside at boot and handed
+// out in blocks of 2^order pages, for 0 <= order <= BUDDYORDER.
+// A free block is split in halves until it is the requested size,
+// and kfree_pages() merges a block with its free buddy, repeatedly,
+// so large blocks reappear as soon as their pieces are freed.
+//
+// Single pages normally come from kalloc()'s per-CPU lists, which
+// stay the order-0 fast path: kalloc_pages(0) is kalloc(), and
+// kalloc() only falls back to this region once every per-CPU list
+// is empty. kfree() sends pages in this region back here.
+//
+// Orders 1 to BCPUORDER have small per-CPU caches in front of the
+// global lists, so most kalloc_pages() and kfree_pages() calls of
+// those orders take only their own CPU's lock; a cache refills or
+// spills half its blocks at a time under the global lock. Larger
+// orders always take the global lock. Blocks sitting in a cache
+// can't merge, so an allocation that fails, and memory pressure,
+// drain the caches back into the lists.
+
+#include "types.h"
+#include "param.h"
+#include "memlayout.h"
+#include "spinlock.h"
+#include "riscv.h"
+#include "defs.h"
+
+#define BCPUORDER 3  // largest order with per-CPU caches
+#define BCPUMAX 8    // blocks of each order a CPU caches
+
+// Links of a free block, stored in its first page.
+struct bnode {
+  struct bnode *next;
+  struct bnode *prev;
+};
+
+struct {
+  struct spinlock lock;
+  struct bnode free[BUDDYORDER+1]; // circular list heads, one per order
+  int nfree[BUDDYORDER+1];         // blocks on each list
+  // order of the free block starting at each page, or -1
+  // if no free block starts there.
+  signed char tag[BUDDYPAGES];
+} buddy;
+
+// Per-CPU caches. Lock order: a CPU's lock before buddy.lock.
+struct {
+  struct spinlock lock;
+  void *blk[BCPUORDER+1][BCPUMAX];
+  int n[BCPUORDER+1];
+
+  // per-order statistics of kalloc_pages() on this CPU, updated
+  // with interrupts off rather than under a lock.
+  int nalloc[BUDDYORDER+1];
+  int nfail[BUDDYORDER+1];
+  uint64 cycles[BUDDYORDER+1];
+} bcpu[NCPU];
+
+static int bcpu_drain(int);
+
+static int
+pageno(void *pa)
+{
+  return ((uint64)pa - BUDDYBASE) / PGSIZE;
+}
+
+static struct bnode*
+pageaddr(int pn)
+{
+  return (struct bnode*)(BUDDYBASE + (uint64)pn*PGSIZE);
+}
+
+static void
+bpush(int pn, int order)
+{
+  struct bnode *b = pageaddr(pn);
+  struct bnode *h = &buddy.free[order];
+
+  b->next = h->next;
+  b->prev = h;
+  h->next->prev = b;
+  h->next = b;
+  buddy.tag[pn] = order;
+  buddy.nfree[order]++;
+}
+
+static void
+bremove(int pn, int order)
+{
+  struct bnode *b = pageaddr(pn);
+
+  b->prev->next = b->next;
+  b->next->prev = b->prev;
+  buddy.tag[pn] = -1;
+  buddy.nfree[order]--;
+}
+
+void
+buddyinit(void)
+{
+  initlock(&buddy.lock, "buddy");
+  for(int k = 0; k <= BUDDYORDER; k++){
+    buddy.free[k].next = &buddy.free[k];
+    buddy.free[k].prev = &buddy.free[k];
+  }
+  for(int pn = 0; pn < BUDDYPAGES; pn++)
+    buddy.tag[pn] = -1;
+  for(int pn = 0; pn < BUDDYPAGES; pn += 1 << BUDDYORDER)
+    bpush(pn, BUDDYORDER);
+  for(int i = 0; i < NCPU; i++)
+    initlock(&bcpu[i].lock, "buddycpu");
+  kreclaim_register(bcpu_drain);
+}
+
+// Is pa inside the region the buddy allocator manages?
+int
+buddy_owns(void *pa)
+{
+  return (uint64)pa >= BUDDYBASE && (uint64)pa < PHYSTOP;
+}
+
+// Take a block of 2^order pages off the lists, with buddy.lock
+// held. Returns 0 if there is no free block large enough.
+static void*
+btake(int order)
+{
+  int k, pn;
+
+  for(k = order; k <= BUDDYORDER; k++)
+    if(buddy.nfree[k] > 0)
+      break;
+  if(k > BUDDYORDER)
+    return 0;
+  pn = pageno(buddy.free[k].next);
+  bremove(pn, k);
+  // split, keeping the lower half and freeing the upper one.
+  while(k > order){
+    k--;
+    bpush(pn + (1 << k), k);
+  }
+  return pageaddr(pn);
+}
+
+// Put a block of 2^order pages back on the lists, with buddy.lock
+// held, merging it with its buddy for as long as the buddy is free.
+static void
+bput(void *pa, int order)
+{
+  int pn, bud;
+
+  pn = pageno(pa);
+  if(!buddy_owns(pa) || (pn & ((1 << order) - 1)) != 0)
+    panic("buddy_free");
+
+  while(order < BUDDYORDER){
+    bud = pn ^ (1 << order);
+    if(buddy.tag[bud] != order)
+      break;
+    bremove(bud, order);
+    if(bud < pn)
+      pn = bud;
+    order++;
+  }
+  bpush(pn, order);
+}
+
+// Allocate a block of 2^order pages from the buddy region.
+// Returns 0 if there is no free block large enough.
+void*
+buddy_alloc(int order)
+{
+  void *pa;
+
+  acquire(&buddy.lock);
+  pa = btake(order);
+  release(&buddy.lock);
+  return pa;
+}
+
+// Return a block of 2^order pages to the buddy region.
+void
+buddy_free(void *pa, int order)
+{
+  acquire(&buddy.lock);
+  bput(pa, order);
+  release(&buddy.lock);
+}
+
+// Allocate a block of a cached order from this CPU's cache,
+// refilling half of it from the lists if it is empty.
+static void*
+bcpu_alloc(int order)
+{
+  void *pa = 0;
+
+  push_off();
+  int cid = cpuid();
+  pop_off();
+
+  acquire(&bcpu[cid].lock);
+  if(bcpu[cid].n[order] == 0){
+    acquire(&buddy.lock);
+    while(bcpu[cid].n[order] < BCPUMAX/2 && (pa = btake(order)) != 0)
+      bcpu[cid].blk[order][bcpu[cid].n[order]++] = pa;
+    release(&buddy.lock);
+  }
+  pa = 0;
+  if(bcpu[cid].n[order] > 0)
+    pa = bcpu[cid].blk[order][--bcpu[cid].n[order]];
+  release(&bcpu[cid].lock);
+  return pa;
+}
+
+// Give a block of a cached order to this CPU's cache, first
+// spilling half of it to the lists if it is full.
+static void
+bcpu_free(void *pa, int order)
+{
+  push_off();
+  int cid = cpuid();
+  pop_off();
+
+  acquire(&bcpu[cid].lock);
+  if(bcpu[cid].n[order] == BCPUMAX){
+    acquire(&buddy.lock);
+    while(bcpu[cid].n[order] > BCPUMAX/2)
+      bput(bcpu[cid].blk[order][--bcpu[cid].n[order]], order);
+    release(&buddy.lock);
+  }
+  bcpu[cid].blk[order][bcpu[cid].n[order]++] = pa;
+  release(&bcpu[cid].lock);
+}
+
+// Return every CPU's cached blocks to the lists, so they can
+// merge. Also a reclaim callback; n is ignored, since pages left
+// in the caches aren't much. Returns the number of pages freed.
+static int
+bcpu_drain(int n)
+{
+  int got = 0;
+
+  for(int i = 0; i < NCPU; i++){
+    acquire(&bcpu[i].lock);
+    acquire(&buddy.lock);
+    for(int k = 1; k <= BCPUORDER; k++){
+      while(bcpu[i].n[k] > 0){
+        bput(bcpu[i].blk[k][--bcpu[i].n[k]], k);
+        got += 1 << k;
+      }
+    }
+    release(&buddy.lock);
+    release(&bcpu[i].lock);
+  }
+  return got;
+}
+
+// Allocate 2^order physically contiguous pages.
+// Returns 0 if the memory cannot be allocated.
+void*
+kalloc_pages(int order)
+{
+  void *pa;
+  uint64 t0;
+
+  if(order < 0 || order > BUDDYORDER)
+    return 0;
+
+  t0 = r_time();
+  if(order == 0){
+    pa = kalloc();
+  } else {
+    pa = order <= BCPUORDER ? bcpu_alloc(order) : buddy_alloc(order);
+    if(pa == 0 && bcpu_drain(0) > 0)
+      pa = buddy_alloc(order);
+    if(pa && kalloc_junk)
+      memset(pa, 5, PGSIZE << order); // fill with junk
+  }
+  t0 = r_time() - t0;
+
+  push_off();
+  int cid = cpuid();
+  if(pa){
+    bcpu[cid].nalloc[order]++;
+    bcpu[cid].cycles[order] += t0;
+  } else {
+    bcpu[cid].nfail[order]++;
+  }
+  pop_off();
+  return pa;
+}
+
+// Free 2^order pages returned by kalloc_pages(order).
+void
+kfree_pages(void *pa, int order)
+{
+  if(order == 0){
+    kfree(pa);
+    return;
+  }
+  if(kalloc_junk)
+    memset(pa, 1, PGSIZE << order);
+  if(order <= BCPUORDER)
+    bcpu_free(pa, order);
+  else
+    buddy_free(pa, order);
+}
+
+#ifdef LAB_LOCK
+// Allocate up to n blocks of 2^order pages, then free them all.
+// The per-order latency and free-block counts show up in the
+// statistics device. Returns the number of blocks allocated.
+int
+buddybench(int order, int n)
+{
+  void **blk;
+  int i;
+
+  if(order < 0 || order > BUDDYORDER || n < 0 || n > PGSIZE/sizeof(void*))
+    return -1;
+  if((blk = kalloc()) == 0)
+    return -1;
+  for(i = 0; i < n; i++)
+    if((blk[i] = kalloc_pages(order)) == 0)
+      break;
+  n = i;
+  for(i = 0; i < n; i++)
+    kfree_pages(blk[i], order);
+  kfree(blk);
+  return n;
+}
+
+// Free blocks and average allocation latency (in timer cycles)
+// for each order. frag is the percentage of free buddy memory
+// that is not in the largest free block size available.
+int
+statsbuddy(char *buf, int sz)
+{
+  int n = 0, k, freepages = 0, largest = -1, cached = 0;
+  int nalloc[BUDDYORDER+1], nfail[BUDDYORDER+1];
+  uint64 cycles[BUDDYORDER+1];
+
+  for(k = 0; k <= BUDDYORDER; k++){
+    nalloc[k] = nfail[k] = 0;
+    cycles[k] = 0;
+    for(int i = 0; i < NCPU; i++){
+      nalloc[k] += lockfree_read4(&bcpu[i].nalloc[k]);
+      nfail[k] += lockfree_read4(&bcpu[i].nfail[k]);
+      cycles[k] += lockfree_read8(&bcpu[i].cycles[k]);
+      if(k >= 1 && k <= BCPUORDER)
+        cached += lockfree_read4(&bcpu[i].n[k]) << k;
+    }
+  }
+  n += snprintf(buf+n, sz-n, "buddy: per-CPU caches hold %d pages\n", cached);
+
+  acquire(&buddy.lock);
+  for(k = 0; k <= BUDDYORDER; k++){
+    freepages += buddy.nfree[k] << k;
+    if(buddy.nfree[k] > 0)
+      largest = k;
+  }
+  n += snprintf(buf+n, sz-n, "buddy: free %d pages largest order %d frag %d%%\n",
+                freepages, largest,
+                freepages == 0 ? 0 : 100 - 100 * (buddy.nfree[largest] << largest) / freepages);
+  for(k = 0; k <= BUDDYORDER; k++){
+    if(buddy.nfree[k] == 0 && nalloc[k] == 0 && nfail[k] == 0)
+      continue;
+    n += snprintf(buf+n, sz-n, "buddy: order %d: free %d #alloc %d #fail %d cycles/alloc %d\n",
+                  k, buddy.nfree[k], nalloc[k], nfail[k],
+                  nalloc[k] == 0 ? 0 : (int)(cycles[k] / nalloc[k]));
+  }
+  release(&buddy.lock);
+  return n;
+}
+#endif
@@ -1,13 +1,15 @@
 struct buf {
   int valid;   // has data been read from disk?
   int disk;    // does disk "own" buf?
+  int ra;      // read ahead by bprefetch() and not used yet?
+  void (*iodone)(struct buf*); // if set, called when a disk request completes
   uint dev;
   uint blockno;
   struct sleeplock lock;
   uint refcnt;
   struct buf *prev; // LRU cache list
   struct buf *next;
-  uchar data[BSIZE];
+  uchar *data;      // BSIZE bytes, in a page shared with other bufs
   uint timeStamp;
 };
 
@@ -0,0 +1,149 @@
+// Directory name lookup cache.
+//
+// Maps (dev, directory inum, name) to the inum of the entry and
+// its offset in the directory, so that dirlookup() can skip
+// reading the directory. An entry with inum 0 records that the
+// name is not there. The cache is set-associative: a name hashes
+// to a bucket of DWAYS entries, and a new entry replaces the
+// bucket's least recently used one.
+//
+// Callers hold the directory's inode lock, and change the cache
+// when they change the directory: dirlink() and sys_unlink() enter
+// what they wrote, and iput() purges a directory it frees, whose
+// inum may be reused.
+
+#include "types.h"
+#include "param.h"
+#include "spinlock.h"
+#include "riscv.h"
+#include "fs.h"
+#include "defs.h"
+
+#define NDBUCKET 32
+#define DWAYS 4
+
+struct dentry {
+  uint dev;
+  uint dinum;       // directory, or 0 if the entry is unused
+  char name[MAXNAME];
+  uint inum;        // 0: name is not in the directory
+  uint off;         // of its dirent
+  uint used;        // bucket clock at last use
+};
+
+struct {
+  struct spinlock lock[NDBUCKET];
+  struct dentry e[NDBUCKET][DWAYS];
+  uint clock[NDBUCKET];
+
+  // statistics, updated under different locks
+  int nhit;
+  int nneg;         // hits on entries saying the name isn't there
+  int nmiss;
+} dcache;
+
+void
+dcacheinit(void)
+{
+  for(int b = 0; b < NDBUCKET; b++)
+    initlock(&dcache.lock[b], "dcache");
+}
+
+static int
+dhash(uint dev, uint dinum, char *name)
+{
+  uint h = dev * 31 + dinum;
+
+  for(int i = 0; i < MAXNAME && name[i]; i++)
+    h = h * 31 + (uchar)name[i];
+  return h % NDBUCKET;
+}
+
+// The entry for name in directory dinum, in bucket b, whose lock
+// the caller holds, or 0.
+static struct dentry*
+dfind(int b, uint dev, uint dinum, char *name)
+{
+  struct dentry *d;
+
+  for(d = dcache.e[b]; d < dcache.e[b] + DWAYS; d++)
+    if(d->dinum == dinum && d->dev == dev && namecmp(d->name, name) == 0)
+      return d;
+  return 0;
+}
+
+// Look name up in directory dinum. Returns 0 if the cache doesn't
+// know; otherwise returns 1, setting *inum to the entry's inum, or
+// to 0 if there is no such entry, and *off to its offset.
+int
+dcache_lookup(uint dev, uint dinum, char *name, uint *inum, uint *off)
+{
+  int b = dhash(dev, dinum, name);
+  struct dentry *d;
+
+  acquire(&dcache.lock[b]);
+  if((d = dfind(b, dev, dinum, name)) == 0){
+    __atomic_fetch_add(&dcache.nmiss, 1, __ATOMIC_RELAXED);
+    release(&dcache.lock[b]);
+    return 0;
+  }
+  d->used = ++dcache.clock[b];
+  *inum = d->inum;
+  *off = d->off;
+  __atomic_fetch_add(d->inum ? &dcache.nhit : &dcache.nneg, 1, __ATOMIC_RELAXED);
+  release(&dcache.lock[b]);
+  return 1;
+}
+
+// Record that name in directory dinum is inum, at offset off,
+// or, if inum is 0, that there is no such name.
+void
+dcache_enter(uint dev, uint dinum, char *name, uint inum, uint off)
+{
+  int b = dhash(dev, dinum, name);
+  struct dentry *d, *victim;
+
+  acquire(&dcache.lock[b]);
+  if((victim = dfind(b, dev, dinum, name)) == 0){
+    victim = dcache.e[b];
+    for(d = dcache.e[b]; d < dcache.e[b] + DWAYS; d++){
+      if(d->dinum == 0){
+        victim = d;
+        break;
+      }
+      if(d->used < victim->used)
+        victim = d;
+    }
+    victim->dev = dev;
+    victim->dinum = dinum;
+    strncpy(victim->name, name, MAXNAME);
+  }
+  victim->inum = inum;
+  victim->off = off;
+  victim->used = ++dcache.clock[b];
+  release(&dcache.lock[b]);
+}
+
+// Forget every name in directory dinum.
+void
+dcache_purge(uint dev, uint dinum)
+{
+  struct dentry *d;
+
+  for(int b = 0; b < NDBUCKET; b++){
+    acquire(&dcache.lock[b]);
+    for(d = dcache.e[b]; d < dcache.e[b] + DWAYS; d++)
+      if(d->dinum == dinum && d->dev == dev)
+        d->dinum = 0;
+    release(&dcache.lock[b]);
+  }
+}
+
+#ifdef LAB_LOCK
+int
+statsdcache(char *buf, int sz)
+{
+  return snprintf(buf, sz, "dcache: #hit %d #negative %d #miss %d\n",
+                  dcache.nhit, dcache.nneg, dcache.nmiss);
+}
+#endif
@@ -2,6 +2,7 @@ struct buf;
 struct context;
 struct file;
 struct inode;
+struct kmem_cache;
 struct pipe;
 struct proc;
 struct spinlock;
@@ -15,11 +16,20 @@ struct sock;
 
 // bio.c
 void            binit(void);
+extern int      nbuf, nbufmax, rawindow;
 struct buf*     bread(uint, uint);
+void            bprefetch(uint, uint*, int);
+struct buf*     bgrab(uint, uint);
+void            bdone(struct buf*);
 void            brelse(struct buf*);
 void            bwrite(struct buf*);
+void            bwrite_start(struct buf**, int);
+void            bwrite_wait(struct buf*);
 void            bpin(struct buf*);
 void            bunpin(struct buf*);
+#ifdef LAB_LOCK
+int             statsbcache(char*, int);
+#endif
 
 // console.c
 void            consoleinit(void);
@@ -37,10 +47,15 @@ void            fileinit(void);
 int             fileread(struct file*, uint64, int n);
 int             filestat(struct file*, uint64 addr);
 int             filewrite(struct file*, uint64, int n);
+int             filesplice(struct file*, struct file*, int n);
 
 // fs.c
 void            fsinit(int);
+struct buf*     ibuf(struct inode*, uint, int);
+int             dirempty(struct inode*);
 int             dirlink(struct inode*, char*, uint);
+int             dirlink_nblocks(int);
+void            dirunlink(struct inode*, char*, uint);
 struct inode*   dirlookup(struct inode*, char*, uint*);
 struct inode*   ialloc(uint, short);
 struct inode*   idup(struct inode*);
@@ -56,29 +71,64 @@ struct inode*   nameiparent(char*, char*);
 int             readi(struct inode*, int, uint64, uint, uint);
 void            stati(struct inode*, struct stat*);
 int             writei(struct inode*, int, uint64, uint, uint);
+int             writei_nblocks(uint, uint);
+int             iput_nblocks(void);
 void            itrunc(struct inode*);
+#ifdef LAB_LOCK
+int             statsnamei(char*, int);
+#endif
 
 // ramdisk.c
 void            ramdiskinit(void);
 void            ramdiskintr(void);
 void            ramdiskrw(struct buf*);
 
+// buddy.c
+void            buddyinit(void);
+int             buddy_owns(void*);
+void*           buddy_alloc(int);
+void            buddy_free(void*, int);
+void*           kalloc_pages(int);
+void            kfree_pages(void*, int);
+#ifdef LAB_LOCK
+int             buddybench(int, int);
+int             statsbuddy(char*, int);
+#endif
+
 // kalloc.c
+extern int      kalloc_junk;
+extern int      kmem_low, kmem_high;
 void*           kalloc(void);
+void*           kalloc_zeroed(void);
 void            kfree(void *);
+int             kfreecount(void);
 void            kinit(void);
+void            kreclaim_register(int (*)(int));
+void            kzero_idle(void);
+#ifdef LAB_LOCK
+int             statskmem(char*, int);
+#endif
 
 // log.c
 void            initlog(int, struct superblock*);
 void            log_write(struct buf*);
+#ifdef LAB_LOCK
+int             statslog(char*, int);
+#endif
 void            begin_op(void);
+void            begin_op_n(int);
 void            end_op(void);
 
 // pipe.c
+void            pipeinit(void);
 int             pipealloc(struct file**, struct file**);
 void            pipeclose(struct pipe*, int);
 int             piperead(struct pipe*, uint64, int);
 int             pipewrite(struct pipe*, uint64, int);
+int             pipewait(struct pipe*, int);
+int             pipewritek(struct pipe*, char*, int);
+int             pipereadk(struct pipe*, char*, int);
+int             statspipe(char*, int);
 
 // printf.c
 void            printf(char*, ...);
@@ -94,6 +144,7 @@ void            proc_mapstacks(pagetable_t);
 pagetable_t     proc_pagetable(struct proc *);
 void            proc_freepagetable(pagetable_t, uint64);
 int             kill(int);
+void            kthread_create(void (*)(void), char*);
 struct cpu*     mycpu(void);
 struct cpu*     getmycpu(void);
 struct proc*    myproc();
@@ -125,6 +176,23 @@ int             lockfree_read4(int *addr);
 void            freelock(struct spinlock*);
 #endif
 
+// slab.c
+void            kmem_cache_init(struct kmem_cache*, char*, uint);
+void*           kmem_cache_alloc(struct kmem_cache*);
+void            kmem_cache_free(struct kmem_cache*, void*);
+#ifdef LAB_LOCK
+int             statsslab(char*, int);
+#endif
+
+// dcache.c
+void            dcacheinit(void);
+int             dcache_lookup(uint, uint, char*, uint*, uint*);
+void            dcache_enter(uint, uint, char*, uint, uint);
+void            dcache_purge(uint, uint);
+#ifdef LAB_LOCK
+int             statsdcache(char*, int);
+#endif
+
 // sleeplock.c
 void            acquiresleep(struct sleeplock*);
 void            releasesleep(struct sleeplock*);
@@ -176,6 +244,7 @@ void            uvmfree(pagetable_t, uint64);
 void            uvmunmap(pagetable_t, uint64, uint64, int);
 void            uvmclear(pagetable_t, uint64);
 uint64          walkaddr(pagetable_t, uint64);
+int             uvmflip(pagetable_t, uint64, char**);
 int             copyout(pagetable_t, uint64, char *, uint64);
 int             copyin(pagetable_t, char *, uint64, uint64);
 int             copyinstr(pagetable_t, char *, uint64, uint64);
@@ -189,7 +258,13 @@ void            plic_complete(int);
 // virtio_disk.c
 void            virtio_disk_init(void);
 void            virtio_disk_rw(struct buf *, int);
+void            virtio_disk_submit(struct buf *, int);
+void            virtio_disk_submitv(struct buf **, int, int);
+void            virtio_disk_wait(struct buf *);
 void            virtio_disk_intr(void);
+#ifdef LAB_LOCK
+int             statsvirtio(char*, int);
+#endif
 
 // number of elements in fixed-size array
 #define NELEM(x) (sizeof(x)/sizeof((x)[0]))
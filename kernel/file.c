@@ -9,20 +9,25 @@
 #include "fs.h"
 #include "spinlock.h"
 #include "sleeplock.h"
+#include "buf.h"
 #include "file.h"
 #include "stat.h"
 #include "proc.h"
+#include "slab.h"
 
 struct devsw devsw[NDEV];
 struct {
   struct spinlock lock;
-  struct file file[NFILE];
+  int nfile;  // open files, at most NFILE
 } ftable;
 
+static struct kmem_cache filecache;
+
 void
 fileinit(void)
 {
   initlock(&ftable.lock, "ftable");
+  kmem_cache_init(&filecache, "file", sizeof(struct file));
 }
 
 // Allocate a file structure.
@@ -32,15 +37,22 @@ filealloc(void)
   struct file *f;
 
   acquire(&ftable.lock);
-  for(f = ftable.file; f < ftable.file + NFILE; f++){
-    if(f->ref == 0){
-      f->ref = 1;
-      release(&ftable.lock);
-      return f;
-    }
+  if(ftable.nfile >= NFILE){
+    release(&ftable.lock);
+    return 0;
   }
+  ftable.nfile++;
   release(&ftable.lock);
-  return 0;
+
+  if((f = kmem_cache_alloc(&filecache)) == 0){
+    acquire(&ftable.lock);
+    ftable.nfile--;
+    release(&ftable.lock);
+    return 0;
+  }
+  memset(f, 0, sizeof(*f));
+  f->ref = 1;
+  return f;
 }
 
 // Increment ref count for file f.
@@ -71,12 +83,14 @@ fileclose(struct file *f)
   ff = *f;
   f->ref = 0;
   f->type = FD_NONE;
+  ftable.nfile--;
   release(&ftable.lock);
+  kmem_cache_free(&filecache, f);
 
   if(ff.type == FD_PIPE){
     pipeclose(ff.pipe, ff.writable);
   } else if(ff.type == FD_INODE || ff.type == FD_DEVICE){
-    begin_op();
+    begin_op_n(iput_nblocks());
     iput(ff.ip);
     end_op();
   }
@@ -159,7 +173,9 @@ filewrite(struct file *f, uint64 addr, int n)
       if(n1 > max)
         n1 = max;
 
-      begin_op();
+      // f->off may move before ilock() if f is shared, so
+      // reserve for the worst case: unaligned, past NDIRECT.
+      begin_op_n(writei_nblocks(NDIRECT*BSIZE + BSIZE-1, n1));
       ilock(f->ip);
       if ((r = writei(f->ip, 1, addr + i, f->off, n1)) > 0)
         f->off += r;
@@ -180,3 +196,110 @@ filewrite(struct file *f, uint64 addr, int n)
   return ret;
 }
 
+
+// Move file bytes into pipe pi straight from the buffer cache.
+static int
+splicetopipe(struct file *f, struct pipe *pi, int n)
+{
+  struct inode *ip = f->ip;
+  struct buf *bp;
+  int tot = 0, m;
+
+  while(tot < n){
+    // wait for room without holding a buffer the reader may need.
+    if(pipewait(pi, 1) < 0)
+      return tot > 0 ? tot : -1;
+    ilock(ip);
+    if((bp = ibuf(ip, f->off, 0)) == 0){
+      iunlock(ip);
+      break;  // end of file
+    }
+    m = n - tot;
+    if(m > BSIZE - f->off % BSIZE)
+      m = BSIZE - f->off % BSIZE;
+    if(m > ip->size - f->off)
+      m = ip->size - f->off;
+    if((m = pipewritek(pi, (char*)bp->data + f->off % BSIZE, m)) > 0)
+      f->off += m;
+    brelse(bp);
+    iunlock(ip);
+    // 0 means pipewait() saw room but no ring page could be had.
+    if(m <= 0)
+      return tot > 0 ? tot : -1;
+    tot += m;
+  }
+  return tot;
+}
+
+// Move bytes from pipe pi into the file's buffer cache blocks.
+// Like read(), waits only for the first bytes. The bytes leave
+// the pipe before a block is allocated for them, so an empty pipe
+// never leaves a block past the end of the file.
+static int
+splicefrompipe(struct pipe *pi, struct file *f, int n)
+{
+  struct inode *ip = f->ip;
+  struct buf *bp;
+  char *stage;
+  int tot = 0, m, i, k, r;
+
+  if((stage = kalloc()) == 0)
+    return -1;
+  while(tot < n){
+    if(tot == 0 && (r = pipewait(pi, 0)) <= 0){
+      kfree(stage);
+      return r;
+    }
+    m = n - tot;
+    if(m > BSIZE)
+      m = BSIZE;
+    if((m = pipereadk(pi, stage, m)) == 0){
+      if(tot > 0)
+        break;  // pipe drained, or another reader took the rest
+      continue;
+    }
+    // f->off may move before ilock(), as in filewrite(), so the
+    // m bytes may straddle two blocks.
+    begin_op_n(writei_nblocks(NDIRECT*BSIZE + BSIZE-1, m));
+    ilock(ip);
+    for(i = 0; i < m; i += k){
+      if((bp = ibuf(ip, f->off, 1)) == 0)
+        break;
+      k = m - i;
+      if(k > BSIZE - f->off % BSIZE)
+        k = BSIZE - f->off % BSIZE;
+      memmove((char*)bp->data + f->off % BSIZE, stage + i, k);
+      log_write(bp);
+      brelse(bp);
+      f->off += k;
+      if(f->off > ip->size)
+        ip->size = f->off;
+    }
+    iupdate(ip);
+    iunlock(ip);
+    end_op();
+    tot += i;
+    if(i < m){
+      // out of blocks; the rest of the bytes are lost.
+      kfree(stage);
+      return tot > 0 ? tot : -1;
+    }
+  }
+  kfree(stage);
+  return tot;
+}
+
+// Move up to n bytes from in to out without copying them through
+// user space. One must be a pipe and the other a file. Returns
+// the number of bytes moved, 0 at the end of in, or -1.
+int
+filesplice(struct file *in, struct file *out, int n)
+{
+  if(in->readable == 0 || out->writable == 0 || n < 0)
+    return -1;
+  if(in->type == FD_INODE && out->type == FD_PIPE)
+    return splicetopipe(in, out->pipe, n);
+  if(in->type == FD_PIPE && out->type == FD_INODE)
+    return splicefrompipe(in->pipe, out, n);
+  return -1;
+}
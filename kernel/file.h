@@ -23,9 +23,14 @@ struct file {
 // in-memory copy of an inode
 struct inode {
   uint dev;           // Device number
-  uint inum;          // Inode number
+  uint inum;          // Inode number, or 0 if on no hash chain
   int ref;            // Reference count
+  struct inode *hnext;  // itable hash chain
+  struct inode *fnext;  // itable free list, if onfree
+  struct inode *fprev;
+  int onfree;
   struct sleeplock lock; // protects everything below here
+  uint seq;           // odd while valid, type, or entries change
   int valid;          // inode has been read from disk?
 
   short type;         // copy of disk inode
@@ -34,6 +39,11 @@ struct inode {
   short nlink;
   uint size;
   uint addrs[NDIRECT+1];
+
+  uint ra_next;       // block a sequential reader reads next
+  uint ra_end;        // blocks before this are already read ahead
+  struct extent ecache; // FS_EXTENT: the extent bmap() found last,
+  uint efbn;            // and the file block it starts at
 };
 
 // map major device number to device functions.
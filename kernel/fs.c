@@ -26,6 +26,8 @@
 // only one device
 struct superblock sb; 
 
+static void bsuminit(int);
+
 // Read the super block.
 static void
 readsb(int dev, struct superblock *sb)
@@ -44,6 +46,7 @@ fsinit(int dev) {
   if(sb.magic != FSMAGIC)
     panic("invalid file system");
   initlog(dev, &sb);
+  bsuminit(dev);
 }
 
 // Zero a block.
@@ -59,26 +62,100 @@ bzero(int dev, int bno)
 }
 
 // Blocks.
+//
+// Each bitmap block's count of free blocks is kept in memory, so
+// balloc() only reads the bitmap blocks that have free blocks.
+// A file's next block goes right after its previous one if that
+// is free, or as soon after it as possible; otherwise allocation
+// is next-fit, going on from where the last one left off.
+
+#define NBMAP 64  // bitmap blocks with a summary, enough for 512K blocks
+
+struct {
+  int nbmap;        // bitmap blocks
+  int nfree[NBMAP]; // free blocks in each; changed with its buf locked
+  uint hint;        // where the next search without a goal starts
+} bsum;
+
+// Free bits in bitmap block i, which covers disk blocks from
+// i*BPB. Bits past the end of the disk don't count.
+static int
+bmaplimit(int i)
+{
+  return min(BPB, sb.size - i*BPB);
+}
+
+// Count the free blocks of each bitmap block.
+static void
+bsuminit(int dev)
+{
+  struct buf *bp;
+  int i, bi;
+
+  bsum.nbmap = sb.size/BPB + 1;
+  if(bsum.nbmap > NBMAP)
+    panic("bsuminit: disk too big");
+  for(i = 0; i < bsum.nbmap; i++){
+    bp = bread(dev, sb.bmapstart + i);
+    bsum.nfree[i] = 0;
+    for(bi = 0; bi < bmaplimit(i); bi++)
+      if((bp->data[bi/8] & (1 << (bi % 8))) == 0)
+        bsum.nfree[i]++;
+    brelse(bp);
+  }
+  bsum.hint = 0;
+}
+
+// First clear bit in bitmap block data at or after bit from and
+// before bit n, or -1. Skips in-use blocks a word at a time.
+static int
+bscan(uchar *data, int from, int n)
+{
+  uint64 *w = (uint64*)data;
+  int bi = from;
+
+  while(bi < n){
+    if(bi % 64 == 0 && w[bi/64] == ~0ULL){
+      bi += 64;
+    } else if(bi % 8 == 0 && data[bi/8] == 0xff){
+      bi += 8;
+    } else if((data[bi/8] & (1 << (bi % 8))) == 0){
+      return bi;
+    } else {
+      bi++;
+    }
+  }
+  return -1;
+}
 
-// Allocate a zeroed disk block.
+// Allocate a zeroed disk block: goal if it is free, or else the
+// first free one after it. goal 0 means no preference.
 static uint
-balloc(uint dev)
+balloc(uint dev, uint goal)
 {
-  int b, bi, m;
+  int k, i, bi, from;
+  uint b;
   struct buf *bp;
 
-  bp = 0;
-  for(b = 0; b < sb.size; b += BPB){
-    bp = bread(dev, BBLOCK(b, sb));
-    for(bi = 0; bi < BPB && b + bi < sb.size; bi++){
-      m = 1 << (bi % 8);
-      if((bp->data[bi/8] & m) == 0){  // Is block free?
-        bp->data[bi/8] |= m;  // Mark block in use.
-        log_write(bp);
-        brelse(bp);
-        bzero(dev, b + bi);
-        return b + bi;
-      }
+  if(goal == 0 || goal >= sb.size)
+    goal = bsum.hint;
+  // the goal's bitmap block, the following ones, and round
+  // again to the part of the goal's block before the goal.
+  for(k = 0; k <= bsum.nbmap; k++){
+    i = (goal/BPB + k) % bsum.nbmap;
+    if(bsum.nfree[i] == 0)
+      continue;
+    from = k == 0 ? goal % BPB : 0;
+    bp = bread(dev, sb.bmapstart + i);
+    if((bi = bscan(bp->data, from, bmaplimit(i))) >= 0){
+      bp->data[bi/8] |= 1 << (bi % 8);  // Mark block in use.
+      bsum.nfree[i]--;
+      log_write(bp);
+      brelse(bp);
+      b = i*BPB + bi;
+      bsum.hint = b + 1;
+      bzero(dev, b);
+      return b;
     }
     brelse(bp);
   }
@@ -98,6 +175,7 @@ bfree(int dev, uint b)
   if((bp->data[bi/8] & m) == 0)
     panic("freeing free block");
   bp->data[bi/8] &= ~m;
+  bsum.nfree[b / BPB]++;
   log_write(bp);
   brelse(bp);
 }
@@ -162,28 +240,59 @@ bfree(int dev, uint b)
 // have locked the inodes involved; this lets callers create
 // multi-step atomic operations.
 //
-// The itable.lock spin-lock protects the allocation of itable
-// entries. Since ip->ref indicates whether an entry is free,
-// and ip->dev and ip->inum indicate which i-node an entry
-// holds, one must hold itable.lock while using any of those fields.
+// The table is hashed on (dev, inum), with a spin-lock for each
+// bucket. An entry is on the hash chain of the i-node it holds,
+// and the bucket lock protects the entry's ref, dev, and inum;
+// one must hold it while using any of those fields. Entries with
+// ref zero also stay on their chain, so that iget() can reuse
+// them, and on a free list, least recently used first, under
+// itable.freelock, from which iget() recycles them. The bucket
+// lock comes before itable.freelock.
 //
 // An ip->lock sleep-lock protects all ip-> fields other than ref,
-// dev, and inum.  One must hold ip->lock in order to
-// read or write that inode's ip->valid, ip->size, ip->type, &c.
+// dev, inum, and the list links.  One must hold ip->lock in order
+// to read or write that inode's ip->valid, ip->size, ip->type, &c.
+
+#define NIBUCKETMAX 31
+
+// Number of inode table entries. There are no boot arguments,
+// so it is set at build time: make NINODE=n.
+int ninode = NINODE;
 
 struct {
-  struct spinlock lock;
-  struct inode inode[NINODE];
+  struct spinlock lock[NIBUCKETMAX];
+  struct inode *head[NIBUCKETMAX]; // hash chains, through hnext
+  int nbucket;
+
+  struct spinlock freelock;
+  struct inode free;               // list head, through fnext/fprev
+
+  struct inode *inode;             // ninode entries
 } itable;
 
+static void ifree_push(struct inode*);
+
 void
 iinit()
 {
-  int i = 0;
-  
-  initlock(&itable.lock, "itable");
-  for(i = 0; i < NINODE; i++) {
+  int i, order = 0;
+
+  while((PGSIZE << order) < ninode * sizeof(struct inode))
+    order++;
+  if((itable.inode = kalloc_pages(order)) == 0)
+    panic("iinit");
+  memset(itable.inode, 0, ninode * sizeof(struct inode));
+
+  // about one bucket per entry.
+  itable.nbucket = min(ninode, NIBUCKETMAX);
+  for(i = 0; i < itable.nbucket; i++)
+    initlock(&itable.lock[i], "itable");
+
+  initlock(&itable.freelock, "itablefree");
+  itable.free.fnext = itable.free.fprev = &itable.free;
+  for(i = 0; i < ninode; i++) {
     initsleeplock(&itable.inode[i].lock, "inode");
+    ifree_push(&itable.inode[i]);
   }
 }
 
@@ -236,38 +345,130 @@ iupdate(struct inode *ip)
   brelse(bp);
 }
 
+// The bucket of inode inum on device dev.
+static int
+ibucket(uint dev, uint inum)
+{
+  return (dev * 31 + inum) % itable.nbucket;
+}
+
+// The table entry for (dev, inum), with its bucket lock held, or 0.
+static struct inode*
+ifind(int b, uint dev, uint inum)
+{
+  struct inode *ip;
+
+  for(ip = itable.head[b]; ip; ip = ip->hnext)
+    if(ip->dev == dev && ip->inum == inum)
+      return ip;
+  return 0;
+}
+
+// Add ip to the end of the free list, the most recently used end.
+// Caller must hold ip's bucket lock, if it has one.
+static void
+ifree_push(struct inode *ip)
+{
+  acquire(&itable.freelock);
+  ip->fprev = itable.free.fprev;
+  ip->fnext = &itable.free;
+  itable.free.fprev->fnext = ip;
+  itable.free.fprev = ip;
+  ip->onfree = 1;
+  release(&itable.freelock);
+}
+
+// Take ip, which is on the free list, off it.
+// Caller must hold itable.freelock.
+static void
+ifree_remove(struct inode *ip)
+{
+  ip->fprev->fnext = ip->fnext;
+  ip->fnext->fprev = ip->fprev;
+  ip->onfree = 0;
+}
+
+// Take the least recently used unreferenced entry off the free
+// list and off its hash chain, for iget() to give a new identity.
+// Holds no locks on entry or return.
+static struct inode*
+irecycle(void)
+{
+  struct inode *ip, **pp;
+  int b;
+
+  for(;;){
+    acquire(&itable.freelock);
+    ip = itable.free.fnext;
+    if(ip == &itable.free)
+      panic("iget: no inodes");
+    b = ip->inum ? ibucket(ip->dev, ip->inum) : -1;
+    release(&itable.freelock);
+
+    // lock the bucket before the free list again; ip may have
+    // been reused or recycled meanwhile.
+    if(b >= 0)
+      acquire(&itable.lock[b]);
+    acquire(&itable.freelock);
+    if(ip->onfree && ip->ref == 0 &&
+       (ip->inum ? ibucket(ip->dev, ip->inum) : -1) == b){
+      ifree_remove(ip);
+      release(&itable.freelock);
+      if(b >= 0){
+        for(pp = &itable.head[b]; *pp != ip; pp = &(*pp)->hnext)
+          ;
+        *pp = ip->hnext;
+        release(&itable.lock[b]);
+      }
+      ip->inum = 0;  // on no chain
+      return ip;
+    }
+    release(&itable.freelock);
+    if(b >= 0)
+      release(&itable.lock[b]);
+  }
+}
+
 // Find the inode with number inum on device dev
 // and return the in-memory copy. Does not lock
 // the inode and does not read it from disk.
 static struct inode*
 iget(uint dev, uint inum)
 {
-  struct inode *ip, *empty;
-
-  acquire(&itable.lock);
-
-  // Is the inode already in the table?
-  empty = 0;
-  for(ip = &itable.inode[0]; ip < &itable.inode[NINODE]; ip++){
-    if(ip->ref > 0 && ip->dev == dev && ip->inum == inum){
-      ip->ref++;
-      release(&itable.lock);
+  struct inode *ip, *empty = 0;
+  int b = ibucket(dev, inum);
+
+  for(;;){
+    acquire(&itable.lock[b]);
+
+    // Is the inode already in the table?
+    if((ip = ifind(b, dev, inum)) != 0){
+      if(ip->ref++ == 0){
+        acquire(&itable.freelock);
+        ifree_remove(ip);
+        release(&itable.freelock);
+      }
+      release(&itable.lock[b]);
+      if(empty)
+        ifree_push(empty);  // lost a race to add it
       return ip;
     }
-    if(empty == 0 && ip->ref == 0)    // Remember empty slot.
-      empty = ip;
-  }
+    if(empty)
+      break;
 
-  // Recycle an inode entry.
-  if(empty == 0)
-    panic("iget: no inodes");
+    // Recycle an inode entry, then look again.
+    release(&itable.lock[b]);
+    empty = irecycle();
+  }
 
   ip = empty;
   ip->dev = dev;
   ip->inum = inum;
   ip->ref = 1;
   ip->valid = 0;
-  release(&itable.lock);
+  ip->hnext = itable.head[b];
+  itable.head[b] = ip;
+  release(&itable.lock[b]);
 
   return ip;
 }
@@ -277,12 +478,51 @@ iget(uint dev, uint inum)
 struct inode*
 idup(struct inode *ip)
 {
-  acquire(&itable.lock);
+  int b = ibucket(ip->dev, ip->inum);
+
+  acquire(&itable.lock[b]);
   ip->ref++;
-  release(&itable.lock);
+  release(&itable.lock[b]);
   return ip;
 }
 
+// ip->seq lets namefast() read ip->valid, ip->type, and the name
+// cache entries of directory ip without ip->lock: a writer, which
+// holds ip->lock, makes it odd while it changes them, and a reader
+// that sees it odd or changed tries again the slow way.
+static void
+iseq_begin(struct inode *ip)
+{
+  ip->seq++;
+  __sync_synchronize();
+}
+
+static void
+iseq_end(struct inode *ip)
+{
+  __sync_synchronize();
+  ip->seq++;
+}
+
+// Start reading ip's seq-protected fields. The result is odd
+// if a writer is busy.
+static uint
+iseq_read(struct inode *ip)
+{
+  uint s = __atomic_load_n(&ip->seq, __ATOMIC_RELAXED);
+
+  __sync_synchronize();
+  return s;
+}
+
+// Did ip's seq-protected fields change since iseq_read() returned s?
+static int
+iseq_changed(struct inode *ip, uint s)
+{
+  __sync_synchronize();
+  return __atomic_load_n(&ip->seq, __ATOMIC_RELAXED) != s;
+}
+
 // Lock the given inode.
 // Reads the inode from disk if necessary.
 void
@@ -299,6 +539,7 @@ ilock(struct inode *ip)
   if(ip->valid == 0){
     bp = bread(ip->dev, IBLOCK(ip->inum, sb));
     dip = (struct dinode*)bp->data + ip->inum%IPB;
+    iseq_begin(ip);
     ip->type = dip->type;
     ip->major = dip->major;
     ip->minor = dip->minor;
@@ -306,7 +547,10 @@ ilock(struct inode *ip)
     ip->size = dip->size;
     memmove(ip->addrs, dip->addrs, sizeof(ip->addrs));
     brelse(bp);
+    ip->ra_next = ip->ra_end = 0;
+    ip->ecache.len = 0;
     ip->valid = 1;
+    iseq_end(ip);
     if(ip->type == 0)
       panic("ilock: no type");
   }
@@ -332,7 +576,9 @@ iunlock(struct inode *ip)
 void
 iput(struct inode *ip)
 {
-  acquire(&itable.lock);
+  int b = ibucket(ip->dev, ip->inum);
+
+  acquire(&itable.lock[b]);
 
   if(ip->ref == 1 && ip->valid && ip->nlink == 0){
     // inode has no links and no other references: truncate and free.
@@ -341,20 +587,25 @@ iput(struct inode *ip)
     // so this acquiresleep() won't block (or deadlock).
     acquiresleep(&ip->lock);
 
-    release(&itable.lock);
+    release(&itable.lock[b]);
 
+    if(ip->type == T_DIR)
+      dcache_purge(ip->dev, ip->inum);
     itrunc(ip);
+    iseq_begin(ip);
     ip->type = 0;
     iupdate(ip);
     ip->valid = 0;
+    iseq_end(ip);
 
     releasesleep(&ip->lock);
 
-    acquire(&itable.lock);
+    acquire(&itable.lock[b]);
   }
 
-  ip->ref--;
-  release(&itable.lock);
+  if(--ip->ref == 0)
+    ifree_push(ip);
+  release(&itable.lock[b]);
 }
 
 // Common idiom: unlock, then put.
@@ -371,18 +622,144 @@ iunlockput(struct inode *ip)
 // in blocks on the disk. The first NDIRECT block numbers
 // are listed in ip->addrs[].  The next NINDIRECT blocks are
 // listed in block ip->addrs[NDIRECT].
+// On a file system made with mkfs -e, addrs[] holds extents
+// instead; see fs.h.
+
+#define IEXT(ip) ((struct extent*)(ip)->addrs)
+
+// Largest file, in blocks.
+static uint
+maxfile(void)
+{
+  return (sb.flags & FS_EXTENT) ? MAXEXTFILE : MAXFILE;
+}
+
+// Remember that extent e, starting at file block fbn, holds
+// block bn of ip, and return bn's disk address.
+static uint
+ehit(struct inode *ip, struct extent *e, uint fbn, uint bn, uint *run)
+{
+  ip->ecache = *e;
+  ip->efbn = fbn;
+  *run = fbn + e->len - bn;
+  return e->start + bn - fbn;
+}
+
+// Return the disk address of block bn of extent-mapped ip, and set
+// *run to the number of blocks from bn on in the same extent.
+// Returns 0 if bn is past the last extent.
+static uint
+emap(struct inode *ip, uint bn, uint *run)
+{
+  struct extent *e = IEXT(ip);
+  struct buf *bp;
+  uint fbn = 0, addr = 0;
+  int i;
+
+  // sequential access stays in one extent for a while.
+  if(bn >= ip->efbn && bn < ip->efbn + ip->ecache.len)
+    return ehit(ip, &ip->ecache, ip->efbn, bn, run);
+
+  for(i = 0; i < NIEXTENT && e[i].len; i++){
+    if(bn < fbn + e[i].len)
+      return ehit(ip, &e[i], fbn, bn, run);
+    fbn += e[i].len;
+  }
+  *run = 0;
+  if(i < NIEXTENT || ip->addrs[NDIRECT] == 0)
+    return 0;
+
+  bp = bread(ip->dev, ip->addrs[NDIRECT]);
+  e = (struct extent*)bp->data;
+  for(i = 0; i < NXEXTENT && e[i].len; i++){
+    if(bn < fbn + e[i].len){
+      addr = ehit(ip, &e[i], fbn, bn, run);
+      break;
+    }
+    fbn += e[i].len;
+  }
+  brelse(bp);
+  return addr;
+}
+
+// Allocate block bn of extent-mapped ip, which is just past its
+// last extent: the disk block after that extent if it is free,
+// so the extent grows, or else the next free one, in a new extent.
+// Returns 0 if ip has no room for another extent.
+static uint
+eappend(struct inode *ip, uint bn)
+{
+  struct extent *e = IEXT(ip);
+  struct buf *bp = 0;
+  uint fbn = 0, addr, goal;
+  int i, ne = NIEXTENT;
+
+  ip->ecache.len = 0;
+  for(i = 0; i < ne && e[i].len; i++)
+    fbn += e[i].len;
+  if(i == ne && ip->addrs[NDIRECT]){
+    bp = bread(ip->dev, ip->addrs[NDIRECT]);
+    e = (struct extent*)bp->data;
+    ne = NXEXTENT;
+    for(i = 0; i < ne && e[i].len; i++)
+      fbn += e[i].len;
+  }
+  if(bn != fbn || (bp && i == 0))
+    panic("eappend");
+
+  goal = i > 0 ? e[i-1].start + e[i-1].len : 0;
+  addr = balloc(ip->dev, goal);
+  if(i > 0 && addr == goal){
+    e[i-1].len++;
+  } else {
+    if(i == ne){
+      if(bp){
+        bfree(ip->dev, addr);
+        brelse(bp);
+        return 0;
+      }
+      // go on in the extent block.
+      ip->addrs[NDIRECT] = balloc(ip->dev, addr + 1);
+      bp = bread(ip->dev, ip->addrs[NDIRECT]);
+      e = (struct extent*)bp->data;
+      i = 0;
+    }
+    e[i].start = addr;
+    e[i].len = 1;
+  }
+  if(bp){
+    log_write(bp);
+    brelse(bp);
+  }
+  return addr;
+}
+
+// The allocation goal for the block after addr.
+static uint
+after(uint addr)
+{
+  return addr ? addr + 1 : 0;
+}
 
 // Return the disk block address of the nth block in inode ip.
-// If there is no such block, bmap allocates one.
+// If there is no such block, bmap allocates one; it returns 0
+// if it can't.
 static uint
 bmap(struct inode *ip, uint bn)
 {
-  uint addr, *a;
+  uint addr, *a, run;
   struct buf *bp;
 
+  if(sb.flags & FS_EXTENT){
+    if((addr = emap(ip, bn, &run)) != 0)
+      return addr;
+    return eappend(ip, bn);
+  }
+
+  // place each new block right after the one before it.
   if(bn < NDIRECT){
     if((addr = ip->addrs[bn]) == 0)
-      ip->addrs[bn] = addr = balloc(ip->dev);
+      ip->addrs[bn] = addr = balloc(ip->dev, bn > 0 ? after(ip->addrs[bn-1]) : 0);
     return addr;
   }
   bn -= NDIRECT;
@@ -390,11 +767,11 @@ bmap(struct inode *ip, uint bn)
   if(bn < NINDIRECT){
     // Load indirect block, allocating if necessary.
     if((addr = ip->addrs[NDIRECT]) == 0)
-      ip->addrs[NDIRECT] = addr = balloc(ip->dev);
+      ip->addrs[NDIRECT] = addr = balloc(ip->dev, after(ip->addrs[NDIRECT-1]));
     bp = bread(ip->dev, addr);
     a = (uint*)bp->data;
     if((addr = a[bn]) == 0){
-      a[bn] = addr = balloc(ip->dev);
+      a[bn] = addr = balloc(ip->dev, after(bn > 0 ? a[bn-1] : ip->addrs[NDIRECT]));
       log_write(bp);
     }
     brelse(bp);
@@ -404,6 +781,119 @@ bmap(struct inode *ip, uint bn)
   panic("bmap: out of range");
 }
 
+// How many of the block addresses a[i..n) are consecutive on disk.
+static uint
+consecutive(uint *a, int n, int i)
+{
+  int k;
+
+  for(k = i + 1; k < n && a[k] != 0 && a[k] == a[k-1] + 1; k++)
+    ;
+  return k - i;
+}
+
+// Like bmap, but return 0 instead of allocating a missing block,
+// and set *run to the number of blocks from bn on that are
+// consecutive on disk, as far as this one lookup can tell.
+static uint
+bmaprun(struct inode *ip, uint bn, uint *run)
+{
+  uint addr, *a;
+  struct buf *bp;
+
+  if(sb.flags & FS_EXTENT)
+    return emap(ip, bn, run);
+
+  *run = 1;
+  if(bn < NDIRECT){
+    if((addr = ip->addrs[bn]) != 0)
+      *run = consecutive(ip->addrs, NDIRECT, bn);
+    return addr;
+  }
+  bn -= NDIRECT;
+  if(bn < NINDIRECT && (addr = ip->addrs[NDIRECT]) != 0){
+    bp = bread(ip->dev, addr);
+    a = (uint*)bp->data;
+    if((addr = a[bn]) != 0)
+      *run = consecutive(a, NINDIRECT, bn);
+    brelse(bp);
+    return addr;
+  }
+  return 0;
+}
+
+// Called by readi before reading block bn of ip. If the reads of
+// ip are sequential, start reading the next rawindow blocks so they
+// are in the cache by the time the reader gets to them.
+// Caller must hold ip->lock.
+static void
+readahead(struct inode *ip, uint bn)
+{
+  uint win, last, a, run, addr[8];
+  int n = 0;
+
+  // rereading the block before bn, as small reads do, still
+  // counts as sequential.
+  if(bn != ip->ra_next && bn + 1 != ip->ra_next){
+    ip->ra_next = ip->ra_end = bn + 1;
+    return;
+  }
+  ip->ra_next = bn + 1;
+
+  win = rawindow;
+  if(win > nbuf / 4)
+    win = nbuf / 4;
+  last = (ip->size + BSIZE - 1) / BSIZE;
+  if(last > bn + 1 + win)
+    last = bn + 1 + win;
+  if(ip->ra_end < bn + 1)
+    ip->ra_end = bn + 1;
+  // one lookup maps a run of consecutive blocks.
+  for(; ip->ra_end < last; ip->ra_end += run){
+    if((a = bmaprun(ip, ip->ra_end, &run)) == 0){
+      run = 1;
+      continue;
+    }
+    if(run > last - ip->ra_end)
+      run = last - ip->ra_end;
+    for(uint i = 0; i < run; i++){
+      addr[n++] = a + i;
+      if(n == NELEM(addr)){
+        bprefetch(ip->dev, addr, n);
+        n = 0;
+      }
+    }
+  }
+  if(n > 0)
+    bprefetch(ip->dev, addr, n);
+}
+
+// Free the blocks of extents e[0..n), up to the first empty one.
+static void
+efree(uint dev, struct extent *e, int n)
+{
+  for(int i = 0; i < n && e[i].len; i++)
+    for(uint b = 0; b < e[i].len; b++)
+      bfree(dev, e[i].start + b);
+}
+
+// Discard the contents of extent-mapped ip.
+static void
+etrunc(struct inode *ip)
+{
+  struct buf *bp;
+
+  efree(ip->dev, IEXT(ip), NIEXTENT);
+  if(ip->addrs[NDIRECT]){
+    bp = bread(ip->dev, ip->addrs[NDIRECT]);
+    efree(ip->dev, (struct extent*)bp->data, NXEXTENT);
+    brelse(bp);
+    bfree(ip->dev, ip->addrs[NDIRECT]);
+  }
+  memset(ip->addrs, 0, sizeof(ip->addrs));
+  ip->ecache.len = 0;
+}
+
 // Truncate inode (discard contents).
 // Caller must hold ip->lock.
 void
@@ -413,6 +903,13 @@ itrunc(struct inode *ip)
   struct buf *bp;
   uint *a;
 
+  if(sb.flags & FS_EXTENT){
+    etrunc(ip);
+    ip->size = 0;
+    iupdate(ip);
+    return;
+  }
+
   for(i = 0; i < NDIRECT; i++){
     if(ip->addrs[i]){
       bfree(ip->dev, ip->addrs[i]);
@@ -464,6 +961,8 @@ readi(struct inode *ip, int user_dst, uint64 dst, uint off, uint n)
     n = ip->size - off;
 
   for(tot=0; tot<n; tot+=m, off+=m, dst+=m){
+    if(rawindow > 0)
+      readahead(ip, off/BSIZE);
     bp = bread(ip->dev, bmap(ip, off/BSIZE));
     m = min(n - tot, BSIZE - off%BSIZE);
     if(either_copyout(user_dst, dst, bp->data + (off % BSIZE), m) == -1) {
@@ -486,16 +985,18 @@ readi(struct inode *ip, int user_dst, uint64 dst, uint off, uint n)
 int
 writei(struct inode *ip, int user_src, uint64 src, uint off, uint n)
 {
-  uint tot, m;
+  uint tot, m, addr;
   struct buf *bp;
 
   if(off > ip->size || off + n < off)
     return -1;
-  if(off + n > MAXFILE*BSIZE)
+  if(off + n > maxfile()*BSIZE)
     return -1;
 
   for(tot=0; tot<n; tot+=m, off+=m, src+=m){
-    bp = bread(ip->dev, bmap(ip, off/BSIZE));
+    if((addr = bmap(ip, off/BSIZE)) == 0)
+      break;
+    bp = bread(ip->dev, addr);
     m = min(n - tot, BSIZE - off%BSIZE);
     if(either_copyin(bp->data + (off % BSIZE), user_src, src, m) == -1) {
       brelse(bp);
@@ -516,16 +1017,272 @@ writei(struct inode *ip, int user_src, uint64 src, uint off, uint n)
   return tot;
 }
 
+// Return the locked buffer holding byte off of ip, for splice().
+// When reading, off must be inside ip; when writing (alloc), it
+// may also be at the end, and bmap() adds a block if needed.
+// Returns 0 if there is no such block. Caller must hold ip->lock,
+// and if alloc, be in a transaction and iupdate() ip afterwards.
+struct buf*
+ibuf(struct inode *ip, uint off, int alloc)
+{
+  uint addr;
+
+  if(alloc ? off > ip->size || off/BSIZE >= maxfile() : off >= ip->size)
+    return 0;
+  if(!alloc && rawindow > 0)
+    readahead(ip, off/BSIZE);
+  if((addr = bmap(ip, off/BSIZE)) == 0)
+    return 0;
+  return bread(ip->dev, addr);
+}
+
+// Bitmap blocks on the disk.
+static int
+nbitmap(void)
+{
+  return sb.size/BPB + 1;
+}
+
+// Most log blocks a writei() of n bytes at off can dirty: the
+// data blocks it spans, the inode, the indirect block if it
+// reaches that far (with extents, the extent block), and a bitmap
+// block for each of those it may have to allocate.
+// For begin_op_n().
+int
+writei_nblocks(uint off, uint n)
+{
+  int nb, nalloc;
+
+  if(n == 0)
+    return 1;
+  nb = (off + n - 1)/BSIZE - off/BSIZE + 1;
+  nalloc = nb;
+  if((off + n - 1)/BSIZE >= NDIRECT || (sb.flags & FS_EXTENT))
+    nalloc++;
+  return nalloc + 1 + min(nalloc, nbitmap());
+}
+
+// Most log blocks an iput() can dirty when it frees the inode:
+// the inode's block and the bitmap blocks of its content.
+int
+iput_nblocks(void)
+{
+  return 1 + min(maxfile() + 1, nbitmap());
+}
+
 // Directories
 
 int
 namecmp(const char *s, const char *t)
 {
-  return strncmp(s, t, DIRSIZ);
+  return strncmp(s, t, MAXNAME);
+}
+
+// Indexed directories, on a file system made with mkfs -d; see
+// fs.h. The caller holds dp->lock.
+
+// Hash of a name; mkfs has a copy.
+static uint
+hdirhash(char *name)
+{
+  uint h = 2166136261;
+
+  for(int i = 0; i < HDIRSIZ && name[i]; i++)
+    h = (h ^ (uchar)name[i]) * 16777619;
+  return h;
+}
+
+// Index block of dp, locked.
+static struct buf*
+hdirindex(struct inode *dp)
+{
+  struct buf *bp = bread(dp->dev, bmap(dp, 0));
+
+  if(((struct hdirindex*)bp->data)->magic != HDIRMAGIC)
+    panic("hdirindex");
+  return bp;
+}
+
+// Byte offset in dp of entry e of bucket block fbn.
+static uint
+hdiroff(uint fbn, struct hdirblk *blk, struct hdirent *e)
+{
+  return fbn*BSIZE + ((char*)e - (char*)blk);
+}
+
+// Look for name in dp; return its inum and set *poff, or return 0.
+static uint
+hdirlookup(struct inode *dp, char *name, uint *poff)
+{
+  struct buf *bp;
+  struct hdirindex *x;
+  struct hdirblk *blk;
+  uint fbn, h = hdirhash(name), inum = 0;
+
+  if(dp->size == 0)
+    return 0;
+  bp = hdirindex(dp);
+  x = (struct hdirindex*)bp->data;
+  fbn = x->bucket[h & ((1 << x->depth) - 1)];
+  brelse(bp);
+
+  bp = bread(dp->dev, bmap(dp, fbn));
+  blk = (struct hdirblk*)bp->data;
+  for(int i = 0; i < HDPB; i++){
+    if(blk->e[i].inum && strncmp(name, blk->e[i].name, HDIRSIZ) == 0){
+      inum = blk->e[i].inum;
+      *poff = hdiroff(fbn, blk, &blk->e[i]);
+      break;
+    }
+  }
+  brelse(bp);
+  return inum;
+}
+
+// Append a zeroed block to dp and return it, locked, setting
+// *fbn to its number, or return 0 if dp can't grow.
+static struct buf*
+hdirgrow(struct inode *dp, uint *fbn)
+{
+  uint addr;
+
+  *fbn = dp->size / BSIZE;
+  if(*fbn >= (1 << HDIRMAXDEPTH) + 1 || (addr = bmap(dp, *fbn)) == 0)
+    return 0;
+  dp->size += BSIZE;
+  iupdate(dp);
+  return bread(dp->dev, addr);  // balloc() zeroed it
+}
+
+// Add (name, inum) to dp, splitting its bucket once if it is full.
+// Returns the entry's offset, or -1 if the bucket is still full.
+static int
+hdirlink(struct inode *dp, char *name, uint inum)
+{
+  struct buf *xb, *bp, *nb;
+  struct hdirindex *x;
+  struct hdirblk *blk, *nblk;
+  uint h = hdirhash(name), fbn, nfbn, d, i;
+  int k, j, off, split = 0;
+
+  if(dp->size == 0){
+    // a new directory: an index and one empty bucket.
+    if((xb = hdirgrow(dp, &fbn)) == 0 || (bp = hdirgrow(dp, &nfbn)) == 0)
+      panic("hdirlink: init");
+    x = (struct hdirindex*)xb->data;
+    x->magic = HDIRMAGIC;
+    x->bucket[0] = nfbn;
+    log_write(xb);
+    brelse(bp);
+    brelse(xb);
+  }
+
+  for(;;){
+    xb = hdirindex(dp);
+    x = (struct hdirindex*)xb->data;
+    fbn = x->bucket[h & ((1 << x->depth) - 1)];
+    bp = bread(dp->dev, bmap(dp, fbn));
+    blk = (struct hdirblk*)bp->data;
+    for(k = 0; k < HDPB; k++)
+      if(blk->e[k].inum == 0)
+        break;
+    if(k < HDPB){
+      blk->e[k].inum = inum;
+      strncpy(blk->e[k].name, name, HDIRSIZ);
+      log_write(bp);
+      off = hdiroff(fbn, blk, &blk->e[k]);
+      brelse(bp);
+      brelse(xb);
+      return off;
+    }
+
+    // full: move the names with hash bit d set to a new bucket.
+    d = blk->depth;
+    if(split++ || (d == x->depth && d == HDIRMAXDEPTH) ||
+       (nb = hdirgrow(dp, &nfbn)) == 0){
+      brelse(bp);
+      brelse(xb);
+      return -1;
+    }
+    if(d == x->depth){
+      for(i = 0; i < (1 << d); i++)
+        x->bucket[i + (1 << d)] = x->bucket[i];
+      x->depth++;
+    }
+    nblk = (struct hdirblk*)nb->data;
+    blk->depth = nblk->depth = d + 1;
+    for(k = j = 0; k < HDPB; k++){
+      if(hdirhash(blk->e[k].name) & (1 << d)){
+        nblk->e[j++] = blk->e[k];
+        memset(&blk->e[k], 0, sizeof(blk->e[k]));
+      }
+    }
+    for(i = 0; i < (1 << x->depth); i++)
+      if(x->bucket[i] == fbn && (i & (1 << d)))
+        x->bucket[i] = nfbn;
+    log_write(nb);
+    log_write(bp);
+    log_write(xb);
+    brelse(nb);
+    brelse(bp);
+    brelse(xb);
+    // the moved names' cached offsets are stale.
+    dcache_purge(dp->dev, dp->inum);
+  }
+}
+
+// Is indexed directory dp empty except for "." and ".."?
+static int
+hdirempty(struct inode *dp)
+{
+  struct buf *bp;
+  struct hdirblk *blk;
+  struct hdirent *e;
+  int empty = 1;
+
+  for(uint fbn = 1; empty && fbn < dp->size / BSIZE; fbn++){
+    bp = bread(dp->dev, bmap(dp, fbn));
+    blk = (struct hdirblk*)bp->data;
+    for(e = blk->e; e < blk->e + HDPB; e++)
+      if(e->inum && namecmp(e->name, ".") != 0 && namecmp(e->name, "..") != 0)
+        empty = 0;
+    brelse(bp);
+  }
+  return empty;
+}
+
+// Is directory dp empty except for "." and ".."?
+int
+dirempty(struct inode *dp)
+{
+  int off;
+  struct dirent de;
+
+  if(sb.flags & FS_HDIR)
+    return hdirempty(dp);
+
+  for(off=2*sizeof(de); off<dp->size; off+=sizeof(de)){
+    if(readi(dp, 0, (uint64)&de, off, sizeof(de)) != sizeof(de))
+      panic("dirempty: readi");
+    if(de.inum != 0)
+      return 0;
+  }
+  return 1;
+}
+
+// Most log blocks dirlink() can dirty, including dp's inode;
+// fresh if dp is a new directory with no entries yet.
+int
+dirlink_nblocks(int fresh)
+{
+  if(sb.flags & FS_HDIR)
+    return fresh ? writei_nblocks(0, 2*BSIZE) : 2 + writei_nblocks(NDIRECT*BSIZE, BSIZE);
+  return writei_nblocks(fresh ? 0 : NDIRECT*BSIZE, sizeof(struct dirent));
 }
 
 // Look for a directory entry in a directory.
 // If found, set *poff to byte offset of entry.
+// The name cache usually answers without reading dp.
 struct inode*
 dirlookup(struct inode *dp, char *name, uint *poff)
 {
@@ -535,20 +1292,41 @@ dirlookup(struct inode *dp, char *name, uint *poff)
   if(dp->type != T_DIR)
     panic("dirlookup not DIR");
 
+  if(dcache_lookup(dp->dev, dp->inum, name, &inum, &off)){
+    if(inum == 0)
+      return 0;
+    if(poff)
+      *poff = off;
+    return iget(dp->dev, inum);
+  }
+
+  if(sb.flags & FS_HDIR){
+    if((inum = hdirlookup(dp, name, &off)) == 0){
+      dcache_enter(dp->dev, dp->inum, name, 0, 0);
+      return 0;
+    }
+    if(poff)
+      *poff = off;
+    dcache_enter(dp->dev, dp->inum, name, inum, off);
+    return iget(dp->dev, inum);
+  }
+
   for(off = 0; off < dp->size; off += sizeof(de)){
     if(readi(dp, 0, (uint64)&de, off, sizeof(de)) != sizeof(de))
       panic("dirlookup read");
     if(de.inum == 0)
       continue;
-    if(namecmp(name, de.name) == 0){
+    if(strncmp(name, de.name, DIRSIZ) == 0){
       // entry matches path element
       if(poff)
         *poff = off;
       inum = de.inum;
+      dcache_enter(dp->dev, dp->inum, name, inum, off);
       return iget(dp->dev, inum);
     }
   }
 
+  dcache_enter(dp->dev, dp->inum, name, 0, 0);
   return 0;
 }
 
@@ -566,6 +1344,14 @@ dirlink(struct inode *dp, char *name, uint inum)
     return -1;
   }
 
+  if(sb.flags & FS_HDIR){
+    iseq_begin(dp);
+    if((off = hdirlink(dp, name, inum)) >= 0)
+      dcache_enter(dp->dev, dp->inum, name, inum, off);
+    iseq_end(dp);
+    return off < 0 ? -1 : 0;
+  }
+
   // Look for an empty dirent.
   for(off = 0; off < dp->size; off += sizeof(de)){
     if(readi(dp, 0, (uint64)&de, off, sizeof(de)) != sizeof(de))
@@ -576,14 +1362,40 @@ dirlink(struct inode *dp, char *name, uint inum)
 
   strncpy(de.name, name, DIRSIZ);
   de.inum = inum;
+  iseq_begin(dp);
   if(writei(dp, 0, (uint64)&de, off, sizeof(de)) != sizeof(de))
     panic("dirlink");
+  dcache_enter(dp->dev, dp->inum, name, inum, off);
+  iseq_end(dp);
 
   return 0;
 }
 
+// Clear the entry for name, at offset off, in directory dp.
+// Caller must hold dp->lock.
+void
+dirunlink(struct inode *dp, char *name, uint off)
+{
+  struct hdirent de;
+  int n = (sb.flags & FS_HDIR) ? sizeof(struct hdirent) : sizeof(struct dirent);
+
+  memset(&de, 0, sizeof(de));
+  iseq_begin(dp);
+  if(writei(dp, 0, (uint64)&de, off, n) != n)
+    panic("unlink: writei");
+  dcache_enter(dp->dev, dp->inum, name, 0, 0);
+  iseq_end(dp);
+}
+
 // Paths
 
+// Longest path element the file system's directories can hold.
+static int
+namelen(void)
+{
+  return (sb.flags & FS_HDIR) ? HDIRSIZ : DIRSIZ;
+}
+
 // Copy the next path element from path into name.
 // Return a pointer to the element following the copied one.
 // The returned path has no leading slashes,
@@ -610,26 +1422,88 @@ skipelem(char *path, char *name)
   while(*path != '/' && *path != 0)
     path++;
   len = path - s;
-  if(len >= DIRSIZ)
-    memmove(name, s, DIRSIZ);
-  else {
-    memmove(name, s, len);
-    name[len] = 0;
-  }
+  if(len > namelen())
+    len = namelen();  // longer names are truncated
+  memmove(name, s, len);
+  name[len] = 0;
   while(*path == '/')
     path++;
   return path;
 }
 
+// Path lookups the lock-free walk resolved, and those that fell
+// back to the locked one.
+static int nfastwalk, nslowwalk;
+
+// Resolve path like namex(), but without locking any inode, from
+// the name cache alone. Returns 1 with the result in *ipp, or 0 if
+// it needs namex() to read a directory or to wait for a writer.
+static int
+namefast(char *path, int nameiparent, char *name, struct inode **ipp)
+{
+  struct inode *ip, *next;
+  uint inum, off, s;
+
+  if(*path == '/')
+    ip = iget(ROOTDEV, ROOTINO);
+  else
+    ip = idup(myproc()->cwd);
+
+  // the reference to ip keeps it in the table; seq tells
+  // whether it held still while we looked at it.
+  while((path = skipelem(path, name)) != 0){
+    if(((s = iseq_read(ip)) & 1) || !ip->valid || ip->type != T_DIR)
+      break;
+    if(nameiparent && *path == '\0'){
+      if(iseq_changed(ip, s))
+        break;
+      *ipp = ip;
+      return 1;
+    }
+    if(!dcache_lookup(ip->dev, ip->inum, name, &inum, &off))
+      break;
+    if(inum == 0){
+      if(iseq_changed(ip, s))
+        break;
+      iput(ip);
+      *ipp = 0;
+      return 1;
+    }
+    // take the reference before checking seq: once it is held,
+    // an unlink can't free the child, and one that ran before
+    // has changed the directory's seq.
+    next = iget(ip->dev, inum);
+    if(iseq_changed(ip, s)){
+      iput(next);
+      break;
+    }
+    iput(ip);
+    ip = next;
+  }
+  if(path == 0 && !nameiparent){
+    *ipp = ip;
+    return 1;
+  }
+  iput(ip);
+  return 0;
+}
+
 // Look up and return the inode for a path name.
 // If parent != 0, return the inode for the parent and copy the final
-// path element into name, which must have room for DIRSIZ bytes.
+// path element into name, which must have room for MAXNAME+1 bytes.
 // Must be called inside a transaction since it calls iput().
+// Tries a lock-free walk first.
 static struct inode*
 namex(char *path, int nameiparent, char *name)
 {
   struct inode *ip, *next;
 
+  if(namefast(path, nameiparent, name, &ip)){
+    __atomic_fetch_add(&nfastwalk, 1, __ATOMIC_RELAXED);
+    return ip;
+  }
+  __atomic_fetch_add(&nslowwalk, 1, __ATOMIC_RELAXED);
+
   if(*path == '/')
     ip = iget(ROOTDEV, ROOTINO);
   else
@@ -663,7 +1537,7 @@ namex(char *path, int nameiparent, char *name)
 struct inode*
 namei(char *path)
 {
-  char name[DIRSIZ];
+  char name[MAXNAME+1];
   return namex(path, 0, name);
 }
 
@@ -672,3 +1546,12 @@ nameiparent(char *path, char *name)
 {
   return namex(path, 1, name);
 }
+
+#ifdef LAB_LOCK
+int
+statsnamei(char *buf, int sz)
+{
+  return snprintf(buf, sz, "namei: #lock-free %d #locked %d\n",
+                  nfastwalk, nslowwalk);
+}
+#endif
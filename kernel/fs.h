@@ -20,14 +20,31 @@ struct superblock {
   uint logstart;     // Block number of first log block
   uint inodestart;   // Block number of first inode block
   uint bmapstart;    // Block number of first free map block
+  uint flags;        // FS_* features, chosen by mkfs
 };
 
 #define FSMAGIC 0x10203040
 
+#define FS_EXTENT 0x1  // inodes map their blocks with extents
+#define FS_HDIR   0x2  // directories are indexed by name hash
+#define FS_LOG2   0x4  // the log is split into two regions
+
 #define NDIRECT 12
 #define NINDIRECT (BSIZE / sizeof(uint))
 #define MAXFILE (NDIRECT + NINDIRECT)
 
+// With FS_EXTENT, an inode's addrs[] holds NIEXTENT extents, each
+// a run of consecutive disk blocks, and addrs[NDIRECT] the block
+// holding NXEXTENT more. The extents map the file's blocks in
+// order; the first one with a zero len ends the list.
+struct extent {
+  uint start;
+  uint len;
+};
+#define NIEXTENT (NDIRECT / 2)
+#define NXEXTENT (BSIZE / sizeof(struct extent))
+#define MAXEXTFILE 65536  // blocks
+
 // On-disk inode structure
 struct dinode {
   short type;           // File type
@@ -58,3 +75,37 @@ struct dirent {
   char name[DIRSIZ];
 };
 
+
+// With FS_HDIR, a directory is instead a hash index of the names
+// in it, which may be up to HDIRSIZ bytes long. Block 0 is a
+// struct hdirindex, whose 2^depth slots name the directory block
+// holding the entries whose name hashes end in the slot's number;
+// a bucket block whose own depth is smaller than the index's
+// serves several slots. A full bucket is split in two by one more
+// hash bit, doubling the index first if its depth is too small.
+#define HDIRSIZ 30
+#define HDIRMAGIC 0x52494448
+#define HDIRMAXDEPTH 7
+
+struct hdirindex {
+  uint magic;                      // HDIRMAGIC
+  uint depth;
+  uint bucket[1 << HDIRMAXDEPTH];  // directory block of each slot
+};
+
+struct hdirent {
+  ushort inum;
+  char name[HDIRSIZ];
+};
+
+// Entries per bucket block.
+#define HDPB (BSIZE / sizeof(struct hdirent) - 1)
+
+struct hdirblk {
+  uint depth;                      // hash bits its names share
+  char pad[sizeof(struct hdirent) - sizeof(uint)];
+  struct hdirent e[HDPB];
+};
+
+// Longest path element either kind of directory can hold.
+#define MAXNAME HDIRSIZ
@@ -9,6 +9,22 @@
 #include "riscv.h"
 #include "defs.h"
 
+#define KMAG 32              // pages cached in each CPU's magazine
+#define KMAGBATCH (KMAG / 2) // pages moved per magazine refill/flush
+#define KZERO 64             // pre-zeroed pages kept per CPU
+#define KZEROBATCH 8         // pages zeroed per idle pass
+#define KREMOTEBATCH 16      // remote frees sent home together
+#define NRECLAIM 8           // reclaim callbacks
+
+// Fill freed and newly allocated pages with junk to catch
+// dangling references. Build with NOJUNK=1 to turn it off, or
+// clear kalloc_junk before kinit() runs.
+#ifdef KALLOC_NOJUNK
+int kalloc_junk = 0;
+#else
+int kalloc_junk = 1;
+#endif
+
 void freerange(void *pa_start, void *pa_end);
 
 extern char end[]; // first address after kernel.
@@ -23,21 +39,179 @@ struct
 {
   struct spinlock lock;
   struct run *freelist;
+  int nfree;  // pages on freelist
+  int nsteal; // batches stolen from other CPUs
+  int stolen; // pages in those batches
+  struct run *zerolist; // pages zeroed by kzero_idle()
+  int nzero;            // pages on zerolist
+  int zhit;             // kalloc_zeroed() served from zerolist
 } kmem[NCPU]; // a list of NCPU kmem struct which contains a freelist(per freelist -> per cpu)
 
+// Pages moved by one steal. 0 means half of the victim's freelist.
+int ksteal_batch = 0;
+
+// The home CPU of every page: the one whose freelist kfree() returns
+// it to. kinit() gives each CPU a contiguous chunk of memory, and a
+// stolen page moves to the thief.
+static uchar khome[(PHYSTOP - KERNBASE) / PGSIZE];
+
+#define KHOME(pa) khome[((uint64)(pa)-KERNBASE) / PGSIZE]
+
+// Memory pressure. When the number of free pages drops below
+// kmem_low, the reclaim callbacks registered by caches are asked
+// to give pages back until kmem_high pages are free again.
+int kmem_low = 64;
+int kmem_high = 256;
+
+struct
+{
+  int (*fn[NRECLAIM])(int); // give back up to n pages, return how many
+  int n;
+  int pressure;  // free pages fell below kmem_low
+  int busy;      // a CPU is running the callbacks
+  int nreclaim;  // reclaim passes
+  int reclaimed; // pages they freed
+} kreclaimer;
+
+// A small per-CPU cache of free pages in front of kmem[cid].freelist.
+// Only the owning CPU uses its magazine, with interrupts off, so
+// alloc/free bursts are absorbed without touching kmem[cid].lock.
+// The counters are only updated while the magazine is checked out.
+struct kmag
+{
+  int n;
+  struct run *page[KMAG];
+  int hit;    // kalloc()/kfree() served without a lock
+  int refill; // refilled from kmem[cid].freelist
+  int flush;  // flushed to kmem[cid].freelist
+  int drain;  // pages taken by another CPU that ran out of memory
+
+  // Pages freed on this CPU whose home is another one, batched per
+  // home CPU so that kmem[home].lock is taken once per KREMOTEBATCH.
+  struct run *rlist[NCPU];
+  struct run *rtail[NCPU];
+  int rn[NCPU];
+  int remote; // pages freed here whose home is another CPU
+  int rflush; // batches sent home
+};
+
+// kpcpu[cid].mag is checked out with an atomic swap and is 0 while in
+// use. That lets a CPU whose kalloc() finds every freelist empty take
+// pages from another CPU's magazine without racing with its owner.
+struct
+{
+  struct kmag *mag;
+  struct kmag store;
+} kpcpu[NCPU];
+
 void kinit()
 {
   for (int i = 0; i < NCPU; ++i)
+  {
     initlock(&kmem[i].lock, "kmem");
-  freerange(end, (void *)PHYSTOP);
+    kpcpu[i].mag = &kpcpu[i].store;
+  }
+  buddyinit();
+  freerange(end, (void *)BUDDYBASE);
 }
 
+// Split [pa_start, pa_end) into NCPU contiguous chunks and put
+// chunk i on kmem[i].freelist, so that no CPU has to steal its
+// first pages and each CPU's pages stay close together.
 void freerange(void *pa_start, void *pa_end)
 {
-  char *p;
-  p = (char *)PGROUNDUP((uint64)pa_start);
-  for (; p + PGSIZE <= (char *)pa_end; p += PGSIZE)
-    kfree(p);
+  char *p, *base;
+  struct run *r;
+  int chunk, cid;
+
+  base = (char *)PGROUNDUP((uint64)pa_start);
+  chunk = ((char *)pa_end - base) / PGSIZE / NCPU + 1;
+  for (p = base; p + PGSIZE <= (char *)pa_end; p += PGSIZE)
+  {
+    if (kalloc_junk)
+      memset(p, 1, PGSIZE);
+    cid = (p - base) / PGSIZE / chunk;
+    KHOME(p) = cid;
+    r = (struct run *)p;
+    acquire(&kmem[cid].lock);
+    r->next = kmem[cid].freelist;
+    kmem[cid].freelist = r;
+    kmem[cid].nfree++;
+    release(&kmem[cid].lock);
+  }
+}
+
+// Check out CPU cid's magazine, or return 0 if someone else has it.
+static struct kmag *
+kmag_get(int cid)
+{
+  return __atomic_exchange_n(&kpcpu[cid].mag, 0, __ATOMIC_ACQUIRE);
+}
+
+static void
+kmag_put(int cid, struct kmag *m)
+{
+  __atomic_store_n(&kpcpu[cid].mag, m, __ATOMIC_RELEASE);
+}
+
+// Move up to KMAGBATCH pages from kmem[cid].freelist into m.
+// This happens once every KMAGBATCH allocations, which makes it
+// the place to look at the free-page watermark.
+static void
+kmag_refill(int cid, struct kmag *m)
+{
+  struct run *r;
+
+  acquire(&kmem[cid].lock);
+  while (m->n < KMAGBATCH && (r = kmem[cid].freelist) != 0)
+  {
+    kmem[cid].freelist = r->next;
+    kmem[cid].nfree--;
+    m->page[m->n++] = r;
+  }
+  release(&kmem[cid].lock);
+  m->refill++;
+
+  if (kreclaimer.n > 0 && kfreecount() < kmem_low)
+    kreclaimer.pressure = 1;
+}
+
+// Move KMAGBATCH pages from m onto kmem[cid].freelist,
+// linking them up before taking the lock.
+static void
+kmag_flush(int cid, struct kmag *m)
+{
+  struct run *head, *tail;
+
+  tail = m->page[m->n - 1];
+  head = tail;
+  for (int i = 1; i < KMAGBATCH; i++)
+  {
+    m->page[m->n - 1 - i]->next = head;
+    head = m->page[m->n - 1 - i];
+  }
+  m->n -= KMAGBATCH;
+
+  acquire(&kmem[cid].lock);
+  tail->next = kmem[cid].freelist;
+  kmem[cid].freelist = head;
+  kmem[cid].nfree += KMAGBATCH;
+  release(&kmem[cid].lock);
+  m->flush++;
+}
+
+// Send the pages m has batched for CPU home back to its freelist.
+static void
+kremote_flush(struct kmag *m, int home)
+{
+  acquire(&kmem[home].lock);
+  m->rtail[home]->next = kmem[home].freelist;
+  kmem[home].freelist = m->rlist[home];
+  kmem[home].nfree += m->rn[home];
+  release(&kmem[home].lock);
+  m->rlist[home] = 0;
+  m->rn[home] = 0;
+  m->rflush++;
 }
 
 // Free the page of physical memory pointed at by v,
@@ -47,23 +221,250 @@ void freerange(void *pa_start, void *pa_end)
 void kfree(void *pa)
 {
   struct run *r;
+  struct kmag *m;
 
   if (((uint64)pa % PGSIZE) != 0 || (char *)pa < end || (uint64)pa >= PHYSTOP)
     panic("kfree");
 
   // Fill with junk to catch dangling refs.
-  memset(pa, 1, PGSIZE);
+  if (kalloc_junk)
+    memset(pa, 1, PGSIZE);
+
+  if (buddy_owns(pa))
+  {
+    buddy_free(pa, 0);
+    return;
+  }
 
   r = (struct run *)pa;
+  int home = KHOME(pa);
 
   push_off();
   int cid = cpuid();
+
+  if ((m = kmag_get(cid)) != 0)
+  {
+    if (home != cid)
+    {
+      if (m->rn[home] == 0)
+        m->rtail[home] = r;
+      r->next = m->rlist[home];
+      m->rlist[home] = r;
+      m->remote++;
+      if (++m->rn[home] == KREMOTEBATCH)
+        kremote_flush(m, home);
+    }
+    else
+    {
+      if (m->n == KMAG)
+        kmag_flush(cid, m);
+      else
+        m->hit++;
+      m->page[m->n++] = r;
+    }
+    kmag_put(cid, m);
+  }
+  else
+  {
+    acquire(&kmem[home].lock);
+    r->next = kmem[home].freelist;
+    kmem[home].freelist = r;
+    kmem[home].nfree++;
+    release(&kmem[home].lock);
+  }
+
   pop_off();
+}
+
+// Move a batch of pages from the CPU with the most free pages onto
+// kmem[cid].freelist. The victim's list is cut in one critical
+// section, and the two locks are never held together.
+// Returns the number of pages moved.
+static int
+ksteal(int cid)
+{
+  struct run *head, *tail;
+  int victim = -1, most = 0, n;
+
+  for (int i = 0; i < NCPU; ++i)
+  {
+    if (i != cid && (n = lockfree_read4(&kmem[i].nfree)) > most)
+    {
+      most = n;
+      victim = i;
+    }
+  }
+  if (victim < 0)
+    return 0;
+
+  acquire(&kmem[victim].lock);
+  n = ksteal_batch > 0 ? ksteal_batch : (kmem[victim].nfree + 1) / 2;
+  if (n > kmem[victim].nfree)
+    n = kmem[victim].nfree;
+  head = tail = kmem[victim].freelist;
+  if (n > 0)
+  {
+    KHOME(tail) = cid;
+    for (int i = 1; i < n; i++)
+    {
+      tail = tail->next;
+      KHOME(tail) = cid;
+    }
+    kmem[victim].freelist = tail->next;
+    kmem[victim].nfree -= n;
+  }
+  release(&kmem[victim].lock);
+  if (n == 0)
+    return 0;
 
   acquire(&kmem[cid].lock);
-  r->next = kmem[cid].freelist;
-  kmem[cid].freelist = r;
+  tail->next = kmem[cid].freelist;
+  kmem[cid].freelist = head;
+  kmem[cid].nfree += n;
+  kmem[cid].nsteal++;
+  kmem[cid].stolen += n;
   release(&kmem[cid].lock);
+  return n;
+}
+
+// Pop a page off kmem[cid].freelist, stealing a batch if it is empty.
+static struct run *
+kfreelist_pop(int cid)
+{
+  struct run *r;
+
+  do
+  {
+    acquire(&kmem[cid].lock);
+    r = kmem[cid].freelist;
+    if (r)
+    {
+      kmem[cid].freelist = r->next;
+      kmem[cid].nfree--;
+    }
+    release(&kmem[cid].lock);
+  } while (r == 0 && ksteal(cid) > 0);
+  return r;
+}
+
+// Pop a page off kmem[i].zerolist. Its first word holds the list
+// link, so clear it again to hand out an all-zero page.
+static struct run *
+kzero_pop(int i)
+{
+  struct run *r;
+
+  acquire(&kmem[i].lock);
+  r = kmem[i].zerolist;
+  if (r)
+  {
+    kmem[i].zerolist = r->next;
+    kmem[i].nzero--;
+  }
+  release(&kmem[i].lock);
+  if (r)
+    r->next = 0;
+  return r;
+}
+
+// Find a page without CPU cid's magazine: take one from the
+// freelists, then from the pre-zeroed pools and the buddy
+// region, and as a last resort from a magazine or the remote
+// frees batched in one. Interrupts must be off.
+static struct run *
+kalloc_slow(int cid)
+{
+  struct run *r;
+  struct kmag *m;
+
+  r = kfreelist_pop(cid);
+
+  for (int i = 0; i < NCPU && r == 0; ++i)
+    r = kzero_pop((cid + i) % NCPU);
+
+  if (r == 0)
+    r = buddy_alloc(0);
+
+  for (int i = 0; i < NCPU && r == 0; ++i)
+  {
+    if ((m = kmag_get(i)) == 0)
+      continue;
+    if (m->n > 0)
+      r = m->page[--m->n];
+    for (int j = 0; j < NCPU && r == 0; ++j)
+    {
+      if (m->rn[j] > 0)
+      {
+        r = m->rlist[j];
+        m->rlist[j] = r->next;
+        m->rn[j]--;
+      }
+    }
+    if (r)
+      m->drain++;
+    kmag_put(i, m);
+  }
+  return r;
+}
+
+// Number of free pages, counting the per-CPU freelists, zeroed
+// pools and magazines, including the remote frees batched in them,
+// but not the buddy region. The counters are read without locks,
+// so the result is approximate.
+int kfreecount(void)
+{
+  int n = 0;
+
+  for (int i = 0; i < NCPU; i++)
+  {
+    n += lockfree_read4(&kmem[i].nfree);
+    n += lockfree_read4(&kmem[i].nzero);
+    n += lockfree_read4(&kpcpu[i].store.n);
+    for (int home = 0; home < NCPU; home++)
+      n += lockfree_read4(&kpcpu[i].store.rn[home]);
+  }
+  return n;
+}
+
+// Register a function that frees up to n pages held by a cache
+// and returns how many it freed. It is called with no locks held
+// and must not sleep.
+void kreclaim_register(int (*fn)(int))
+{
+  if (kreclaimer.n >= NRECLAIM)
+    panic("kreclaim_register");
+  kreclaimer.fn[kreclaimer.n++] = fn;
+}
+
+// Run the reclaim callbacks until n pages are freed.
+// Only one CPU reclaims at a time; the others return 0.
+// Returns the number of pages freed.
+static int
+kreclaim(int n)
+{
+  int got = 0;
+
+  if (__atomic_exchange_n(&kreclaimer.busy, 1, __ATOMIC_ACQUIRE))
+    return 0;
+  for (int i = 0; i < kreclaimer.n && got < n; i++)
+    got += kreclaimer.fn[i](n - got);
+  kreclaimer.nreclaim++;
+  kreclaimer.reclaimed += got;
+  kreclaimer.pressure = 0;
+  __atomic_store_n(&kreclaimer.busy, 0, __ATOMIC_RELEASE);
+  return got;
+}
+
+// Bring the free-page count back up to kmem_high.
+static void
+kreclaim_high(void)
+{
+  int n = kmem_high - kfreecount();
+
+  if (n > 0)
+    kreclaim(n);
+  else
+    kreclaimer.pressure = 0;
 }
 
 // Allocate one 4096-byte page of physical memory.
@@ -71,38 +472,131 @@ void kfree(void *pa)
 // Returns 0 if the memory cannot be allocated.
 void *kalloc(void)
 {
-  struct run *r;
+  struct run *r = 0;
+  struct kmag *m;
+  // With interrupts on, the caller holds no spinlock, so it is
+  // safe to call into the caches to reclaim memory.
+  int canreclaim = intr_get();
+
+  if (canreclaim && kreclaimer.pressure)
+    kreclaim_high();
 
+again:
   push_off();
   int cid = cpuid();
-  pop_off();
 
-  acquire(&kmem[cid].lock);
-  r = kmem[cid].freelist;
-  if (r)
-    kmem[cid].freelist = r->next;
-  else
+  if ((m = kmag_get(cid)) != 0)
   {
-    for (int i = 0; i < NCPU; ++i)
+    if (m->n > 0)
+      m->hit++;
+    else
     {
-      if (i != cid)
-      {
-        acquire(&kmem[i].lock);
-        r = kmem[i].freelist;
-        if (r)
-        {
-          kmem[i].freelist = r->next;
-          release(&kmem[i].lock);
-          break;
-        }
-        release(&kmem[i].lock);
-      }
+      kmag_refill(cid, m);
+      if (m->n == 0 && ksteal(cid) > 0)
+        kmag_refill(cid, m);
     }
+    if (m->n > 0)
+      r = m->page[--m->n];
+    kmag_put(cid, m);
   }
+  if (r == 0)
+    r = kalloc_slow(cid);
 
-  release(&kmem[cid].lock);
+  pop_off();
 
-  if (r)
+  if (r == 0 && canreclaim && kreclaim(kmem_high) > 0)
+  {
+    canreclaim = 0;
+    goto again;
+  }
+
+  if (r && kalloc_junk)
     memset((char *)r, 5, PGSIZE); // fill with junk
   return (void *)r;
 }
+
+// Allocate one zeroed page, preferably from this CPU's pool of pages
+// that kzero_idle() cleared ahead of time. Returns 0 if the memory
+// cannot be allocated.
+void *kalloc_zeroed(void)
+{
+  struct run *r;
+
+  push_off();
+  int cid = cpuid();
+  r = kzero_pop(cid);
+  if (r)
+    kmem[cid].zhit++;
+  pop_off();
+
+  if (r == 0 && (r = kalloc()) != 0)
+    memset((char *)r, 0, PGSIZE);
+  return (void *)r;
+}
+
+// Called by the scheduler when it finds nothing to run: reclaim
+// memory if it is short, and zero a few pages from this CPU's
+// freelist so kalloc_zeroed() doesn't have to.
+void kzero_idle(void)
+{
+  struct run *r;
+
+  if (kreclaimer.pressure)
+    kreclaim_high();
+
+  push_off();
+  int cid = cpuid();
+  pop_off();
+
+  for (int i = 0; i < KZEROBATCH; i++)
+  {
+    // an idle CPU comes here often: don't take the lock, which
+    // kfree() and ksteal() contend for, when there's nothing to do.
+    if (lockfree_read4(&kmem[cid].nzero) >= KZERO || lockfree_read4(&kmem[cid].nfree) == 0)
+      return;
+    acquire(&kmem[cid].lock);
+    r = 0;
+    if (kmem[cid].nzero < KZERO && (r = kmem[cid].freelist) != 0)
+    {
+      kmem[cid].freelist = r->next;
+      kmem[cid].nfree--;
+    }
+    release(&kmem[cid].lock);
+    if (r == 0)
+      return;
+
+    memset((char *)r, 0, PGSIZE);
+
+    acquire(&kmem[cid].lock);
+    r->next = kmem[cid].zerolist;
+    kmem[cid].zerolist = r;
+    kmem[cid].nzero++;
+    release(&kmem[cid].lock);
+  }
+}
+
+#ifdef LAB_LOCK
+// Per-CPU allocator counters for the statistics device.
+int statskmem(char *buf, int sz)
+{
+  int n = 0, remote = 0, rflush = 0;
+  struct kmag *m;
+
+  for (int i = 0; i < NCPU; i++)
+  {
+    m = &kpcpu[i].store;
+    remote += m->remote;
+    rflush += m->rflush;
+    if (m->hit == 0 && m->refill == 0 && m->drain == 0 && kmem[i].nsteal == 0)
+      continue;
+    n += snprintf(buf + n, sz - n, "kmem: cpu %d: free %d magazine %d #hit %d #refill %d #flush %d #drain %d #steal %d (%d pages) zeroed %d #zhit %d\n",
+                  i, kmem[i].nfree, m->n, m->hit, m->refill, m->flush, m->drain,
+                  kmem[i].nsteal, kmem[i].stolen, kmem[i].nzero, kmem[i].zhit);
+  }
+  n += snprintf(buf + n, sz - n, "kmem: cross-CPU frees %d pages in %d batches\n",
+                remote, rflush);
+  n += snprintf(buf + n, sz - n, "kmem: free %d low %d high %d #reclaim %d (%d pages)\n",
+                kfreecount(), kmem_low, kmem_high, kreclaimer.nreclaim, kreclaimer.reclaimed);
+  return n;
+}
+#endif
@@ -3,6 +3,7 @@
 #include "defs.h"
 #include "param.h"
 #include "spinlock.h"
+#include "proc.h"
 #include "sleeplock.h"
 #include "fs.h"
 #include "buf.h"
@@ -10,201 +11,572 @@
 // Simple logging that allows concurrent FS system calls.
 //
 // A log transaction contains the updates of multiple FS system
-// calls. The logging system only commits when there are
-// no FS system calls active. Thus there is never
+// calls. A transaction is only closed when there are no FS
+// system calls active in it. Thus there is never
 // any reasoning required about whether a commit might
 // write an uncommitted system call's updates to disk.
 //
 // A system call should call begin_op()/end_op() to mark
-// its start and end. Usually begin_op() just increments
-// the count of in-progress FS system calls and returns.
-// But if it thinks the log is close to running out, it
-// sleeps until the last outstanding end_op() commits.
+// its start and end. Usually begin_op() just reserves log
+// space for the call and returns. But if the space isn't
+// there, it sleeps until the log-writer thread closes the
+// transaction. begin_op() reserves MAXOPBLOCKS blocks; a call
+// that knows it writes fewer uses begin_op_n() instead.
+//
+// Commits are done by the log-writer thread, not by end_op().
+// Once no system call is active, the writer closes the open
+// transaction when it holds LOGGROUP blocks, when a begin_op()
+// is waiting for space, or LOGDELAY ticks after its first block
+// was logged, so that a stream of system calls shares one commit.
+// Closing copies every logged block into a log buffer; after that,
+// system calls go on into the next transaction while the writer
+// puts the closed one on disk.
 //
 // The log is a physical re-do log containing disk blocks.
-// The on-disk log format:
-//   header block, containing block #s for block A, B, C, ...
+// mkfs chooses the number of log blocks (mkfs -l). If there are
+// enough, it also sets FS_LOG2 to split them into two regions,
+// and commits alternate between them. The on-disk format of a region:
+//   header blocks, containing a sequence number, a checksum,
+//     and block #s for block A, B, C, ...
 //   block A
 //   block B
 //   block C
 //   ...
-// Log appends are synchronous.
+//
+// The checksum covers the header and the logged blocks, so the
+// header and the blocks can be written at once, and recovery
+// ignores a region whose transaction didn't make it to disk.
+// That also makes it unnecessary to clear the header after
+// installing a transaction: recovery installs it again, which
+// is harmless, and a later commit overwrites the blocks it
+// checksums. Recovery installs the valid regions oldest first.
+//
+// Installing a committed transaction at the blocks' home
+// locations is write-behind: its blocks stay pinned in the
+// cache, and the writer installs it when it has nothing else
+// to do, or when the next commit needs its region. While the
+// next transaction is committed in the other region, blocks it
+// logged again need not be installed from the older one.
+// Log appends are synchronous, but up to LOGBATCH block writes
+// are handed to the disk before waiting for any of them.
+
+#define LOGBATCH 8
+#define LOGDELAY 1             // ticks a transaction waits for company
 
-// Contents of the header block, used for both the on-disk header block
+// Contents of the header blocks, used for both the on-disk header
 // and to keep track in memory of logged block# before commit.
+// On disk, the fields are laid out as consecutive uints starting
+// in the first header block and running into the next ones.
 struct logheader {
+  uint seq;     // commit sequence number
+  uint cksum;   // of the header and the logged blocks
   int n;
-  int block[LOGSIZE];
+  int block[MAXLOGSIZE];
+};
+#define LOGHDRWORDS 3  // uints before block[]
+#define LOGHDRMAX ((LOGHDRWORDS + MAXLOGSIZE) * sizeof(uint) / BSIZE + 1)
+
+// A log region and the transaction committed in it.
+// Used only by the writer thread, after recovery.
+struct logregion {
+  int start;                    // first header block
+  struct logheader lh;          // the transaction in it.
+  int pending;                  // committed but not yet installed.
+  struct buf *copy[MAXLOGSIZE]; // its blocks as of closing, in log buffers.
+  struct buf *home[MAXLOGSIZE]; // the cached (pinned) blocks themselves.
 };
 
 struct log {
   struct spinlock lock;
-  int start;
-  int size;
+  int nregion;     // 1, or 2 if the log is big enough.
+  int nhdr;        // header blocks per region
+  int cap;         // data blocks per region
+  int size;        // data blocks a transaction may use
+  int group;       // blocks that make a transaction close at once
+  uint seq;        // of the last committed transaction
   int outstanding; // how many FS sys calls are executing.
-  int committing;  // in commit(), please wait.
+  int reserved;    // log blocks they have reserved.
+  int committing;  // the writer is closing the transaction, please wait.
+  int nwait;       // begin_op() callers waiting for log space.
+  uint opened;     // ticks when the open transaction logged its first block.
+  void *wchan;     // what the writer sleeps on, or 0.
   int dev;
-  struct logheader lh;
+  struct logheader lh;  // the open transaction.
+
+  // used only by the writer thread.
+  struct logregion region[2];
+  struct buf scratch[LOGBATCH]; // for writing copies to home locations.
+
+  // statistics
+  uint started;    // ticks when the writer started.
+  int ncommit;
+  int nblocks;     // blocks in those commits.
+  int ninstall;    // blocks written to their home location.
+  int nabsorb;     // blocks left to a later commit instead.
 };
 struct log log;
 
 static void recover_from_log(void);
-static void commit();
+static void logwriter(void);
+
+// Divide the nlog log blocks into nregion regions, setting the
+// header and data blocks of each.
+static void
+log_geometry(int nlog, int nregion)
+{
+  int rsize = nlog / nregion;
+
+  // enough header blocks for a block # per data block.
+  log.nregion = nregion;
+  log.nhdr = 1;
+  while ((log.nhdr*BSIZE/sizeof(uint) - LOGHDRWORDS) < rsize - log.nhdr)
+    log.nhdr++;
+  log.cap = rsize - log.nhdr;
+  if (log.cap > MAXLOGSIZE)
+    log.cap = MAXLOGSIZE;
+}
+
+// Data blocks a transaction may use with the current geometry.
+// Each pending region's transaction holds a copy of its blocks
+// and pins them until installed, and the open transaction pins
+// its own; bshrink() may take the cache down to nbuf buffers,
+// so those must cover all of it, with room left for reads.
+static int
+log_txsize(void)
+{
+  int size = nbuf / (2*log.nregion + 2);
+
+  return size < log.cap ? size : log.cap;
+}
 
 void
 initlog(int dev, struct superblock *sb)
 {
-  if (sizeof(struct logheader) >= BSIZE)
-    panic("initlog: too big logheader");
-
   initlock(&log.lock, "log");
-  log.start = sb->logstart;
-  log.size = sb->nlog;
   log.dev = dev;
+
+  // the split is fixed by the superblock, so recovery finds the
+  // regions where the kernel that wrote them put them; nbuf only
+  // limits how much of each a transaction may use.
+  log_geometry(sb->nlog, (sb->flags & FS_LOG2) ? 2 : 1);
+  for (int r = 0; r < log.nregion; r++)
+    log.region[r].start = sb->logstart + r*(sb->nlog/log.nregion);
+
+  log.size = log_txsize();
+  if (log.size < MAXOPBLOCKS)
+    panic("initlog: log too small");
+  log.group = log.size / 2;
+
+  for (int i = 0; i < LOGBATCH; i++)
+    initsleeplock(&log.scratch[i].lock, "logscratch");
   recover_from_log();
+  log.started = ticks;
+  kthread_create(logwriter, "logwriter");
 }
 
-// Copy committed blocks from log to their home location
-static void
-install_trans(int recovering)
+// The checksum of a transaction starts from log_seed() of its
+// header and folds in the block # and data of each logged block.
+static uint
+log_seed(struct logheader *h)
 {
-  int tail;
+  return h->seq ^ h->n;
+}
 
-  for (tail = 0; tail < log.lh.n; tail++) {
-    struct buf *lbuf = bread(log.dev, log.start+tail+1); // read log block
-    struct buf *dbuf = bread(log.dev, log.lh.block[tail]); // read dst
-    memmove(dbuf->data, lbuf->data, BSIZE);  // copy block to dst
-    bwrite(dbuf);  // write dst to disk
-    if(recovering == 0)
-      bunpin(dbuf);
+static uint
+log_cksum(uint ck, int blockno, uchar *data)
+{
+  uint *w = (uint*)data;
+
+  ck = (ck << 5 | ck >> 27) ^ blockno;
+  for (int j = 0; j < BSIZE/sizeof(uint); j++)
+    ck = (ck << 5 | ck >> 27) ^ w[j];
+  return ck;
+}
+
+// Does region r on disk hold the whole transaction its header
+// describes? Called at boot, before the log is in use.
+static int
+log_valid(struct logregion *r)
+{
+  struct buf *lbuf;
+  uint ck;
+
+  if (r->lh.n <= 0 || r->lh.n > log.cap)
+    return 0;
+  ck = log_seed(&r->lh);
+  for (int i = 0; i < r->lh.n; i++) {
+    lbuf = bread(log.dev, r->start+log.nhdr+i);
+    ck = log_cksum(ck, r->lh.block[i], lbuf->data);
     brelse(lbuf);
-    brelse(dbuf);
   }
+  return ck == r->lh.cksum;
 }
 
-// Read the log header from disk into the in-memory log header
+// Copy committed blocks from region r of the on-disk log to their
+// home location, after a crash.
+// Up to LOGBATCH writes are in flight at a time.
 static void
-read_head(void)
+recover_trans(struct logregion *r)
 {
-  struct buf *buf = bread(log.dev, log.start);
-  struct logheader *lh = (struct logheader *) (buf->data);
-  int i;
-  log.lh.n = lh->n;
-  for (i = 0; i < log.lh.n; i++) {
-    log.lh.block[i] = lh->block[i];
+  struct buf *dbuf[LOGBATCH];
+  int tail, i, n;
+
+  for (tail = 0; tail < r->lh.n; tail += n) {
+    n = r->lh.n - tail;
+    if(n > LOGBATCH)
+      n = LOGBATCH;
+    for (i = 0; i < n; i++) {
+      struct buf *lbuf = bread(log.dev, r->start+log.nhdr+tail+i); // read log block
+      dbuf[i] = bread(log.dev, r->lh.block[tail+i]); // read dst
+      memmove(dbuf[i]->data, lbuf->data, BSIZE);  // copy block to dst
+      brelse(lbuf);
+    }
+    bwrite_start(dbuf, n);  // write dst to disk
+    for (i = 0; i < n; i++) {
+      bwrite_wait(dbuf[i]);
+      brelse(dbuf[i]);
+    }
   }
-  brelse(buf);
 }
 
-// Write in-memory log header to disk.
-// This is the true point at which the
-// current transaction commits.
+// Is blockno logged by the transaction in region r?
+static int
+logged(struct logregion *r, int blockno)
+{
+  for (int i = 0; i < r->lh.n; i++)
+    if (r->lh.block[i] == blockno)
+      return 1;
+  return 0;
+}
+
+// Copy the blocks of the transaction committed in region r to
+// their home location, and free the region for the next commit.
+// r must be the older of the pending regions. The cached blocks
+// may already hold changes from later transactions, so write the
+// copies taken when it closed, through scratch bufs that point at
+// the copies' data. A block that the other region's transaction
+// logged again is left to that one: until it is installed, the
+// other region stays intact, and recovery would replay it.
 static void
-write_head(void)
+install_trans(struct logregion *r)
 {
-  struct buf *buf = bread(log.dev, log.start);
-  struct logheader *hb = (struct logheader *) (buf->data);
-  int i;
-  hb->n = log.lh.n;
-  for (i = 0; i < log.lh.n; i++) {
-    hb->block[i] = log.lh.block[i];
+  struct logregion *next = &log.region[(r - log.region + 1) % log.nregion];
+  struct buf *sbuf[LOGBATCH];
+  int i, n, nabsorb = 0;
+
+  if (next == r || !next->pending)
+    next = 0;
+  for (i = 0; i < r->lh.n; ) {
+    for (n = 0; n < LOGBATCH && i < r->lh.n; i++) {
+      if (next && logged(next, r->lh.block[i])) {
+        nabsorb++;
+        continue;
+      }
+      sbuf[n] = &log.scratch[n];
+      acquiresleep(&sbuf[n]->lock);
+      sbuf[n]->dev = log.dev;
+      sbuf[n]->blockno = r->lh.block[i];
+      sbuf[n]->data = r->copy[i]->data;
+      n++;
+    }
+    if (n == 0)
+      break;
+    bwrite_start(sbuf, n);  // write dst to disk
+    for (int j = 0; j < n; j++) {
+      bwrite_wait(sbuf[j]);
+      releasesleep(&sbuf[j]->lock);
+    }
+  }
+  for (i = 0; i < r->lh.n; i++) {
+    bunpin(r->home[i]);
+    brelse(r->copy[i]);
+  }
+  log.ninstall += r->lh.n - nabsorb;
+  log.nabsorb += nabsorb;
+  r->pending = 0;
+}
+
+// The region with the oldest uninstalled transaction, or 0.
+static struct logregion*
+oldest_pending(void)
+{
+  struct logregion *r, *old = 0;
+
+  for (r = log.region; r < log.region + log.nregion; r++)
+    if (r->pending && (old == 0 || (int)(r->lh.seq - old->lh.seq) < 0))
+      old = r;
+  return old;
+}
+
+// Header blocks needed for a transaction of n blocks.
+static int
+hdrblocks(int n)
+{
+  return ((LOGHDRWORDS + n) * sizeof(uint) + BSIZE - 1) / BSIZE;
+}
+
+// Read the header of region r from disk into r->lh.
+static void
+read_head(struct logregion *r)
+{
+  uint *w = (uint*)&r->lh;
+  int i, nw = LOGHDRWORDS;
+
+  for (i = 0; i < log.nhdr && i*BSIZE/sizeof(uint) < nw; i++) {
+    struct buf *buf = bread(log.dev, r->start+i);
+    uint *hw = (uint*)buf->data;
+    for (int j = 0; j < BSIZE/sizeof(uint); j++) {
+      int k = i*BSIZE/sizeof(uint) + j;
+      if (k < LOGHDRWORDS + MAXLOGSIZE)
+        w[k] = hw[j];
+    }
+    if (i == 0 && r->lh.n > 0 && r->lh.n <= log.cap)
+      nw += r->lh.n;
+    brelse(buf);
+  }
+}
+
+// Fill in the header blocks of region r for its transaction,
+// returning the locked header bufs in hbuf[] and their number.
+static int
+fill_head(struct logregion *r, struct buf **hbuf)
+{
+  struct logheader *h = &r->lh;
+  uint *w = (uint*)h;
+  int i, nhdr = hdrblocks(h->n);
+
+  for (i = 0; i < nhdr; i++) {
+    hbuf[i] = bgrab(log.dev, r->start+i);
+    uint *hw = (uint*)hbuf[i]->data;
+    memset(hw, 0, BSIZE);
+    for (int j = 0; j < BSIZE/sizeof(uint); j++) {
+      int k = i*BSIZE/sizeof(uint) + j;
+      if (k >= LOGHDRWORDS + h->n)
+        break;
+      hw[j] = w[k];
+    }
   }
-  bwrite(buf);
-  brelse(buf);
+  return nhdr;
 }
 
 static void
 recover_from_log(void)
 {
-  read_head();
-  install_trans(1); // if committed, copy from log to disk
+  struct logregion *r, *valid[2];
+  int nvalid = 0;
+
+  log.seq = 0;
+  for (r = log.region; r < log.region + log.nregion; r++) {
+    read_head(r);
+    if (log_valid(r)) {
+      if (nvalid > 0 && (int)(r->lh.seq - valid[0]->lh.seq) < 0) {
+        valid[1] = valid[0];
+        valid[0] = r;
+      } else {
+        valid[nvalid] = r;
+      }
+      nvalid++;
+    }
+    r->pending = 0;
+  }
+  // if committed, copy from log to disk, oldest first.
+  for (int i = 0; i < nvalid; i++)
+    recover_trans(valid[i]);
+  if (nvalid > 0)
+    log.seq = valid[nvalid-1]->lh.seq;
   log.lh.n = 0;
-  write_head(); // clear the log
 }
 
-// called at the start of each FS system call.
+// wake up the log-writer thread, with log.lock held.
+static void
+wakewriter(void)
+{
+  if(log.wchan)
+    wakeup(log.wchan);
+}
+
+// called at the start of each FS system call that writes
+// at most n blocks.
 void
-begin_op(void)
+begin_op_n(int n)
 {
+  struct proc *p = myproc();
+
+  // no FS system call writes more than MAXOPBLOCKS.
+  if(n > MAXOPBLOCKS)
+    n = MAXOPBLOCKS;
+
   acquire(&log.lock);
   while(1){
     if(log.committing){
       sleep(&log, &log.lock);
-    } else if(log.lh.n + (log.outstanding+1)*MAXOPBLOCKS > LOGSIZE){
+    } else if(log.lh.n + log.reserved + n > log.size){
       // this op might exhaust log space; wait for commit.
+      log.nwait++;
+      wakewriter();
       sleep(&log, &log.lock);
+      log.nwait--;
     } else {
       log.outstanding += 1;
+      log.reserved += n;
+      p->logres = n;
       release(&log.lock);
       break;
     }
   }
 }
 
+// called at the start of each FS system call.
+void
+begin_op(void)
+{
+  begin_op_n(MAXOPBLOCKS);
+}
+
 // called at the end of each FS system call.
-// commits if this was the last outstanding operation.
+// lets the log-writer know if this was the last outstanding
+// operation, so the transaction can be closed.
 void
 end_op(void)
 {
-  int do_commit = 0;
-
   acquire(&log.lock);
   log.outstanding -= 1;
+  log.reserved -= myproc()->logres;
   if(log.committing)
     panic("log.committing");
   if(log.outstanding == 0){
-    do_commit = 1;
-    log.committing = 1;
+    wakewriter();
   } else {
     // begin_op() may be waiting for log space,
-    // and decrementing log.outstanding has decreased
-    // the amount of reserved space.
+    // and this op's reservation is now free.
     wakeup(&log);
   }
   release(&log.lock);
+}
 
-  if(do_commit){
-    // call commit w/o holding locks, since not allowed
-    // to sleep with locks.
-    commit();
-    acquire(&log.lock);
-    log.committing = 0;
-    wakeup(&log);
-    release(&log.lock);
+// Can the writer close the open transaction? Called with log.lock held.
+static int
+closable(void)
+{
+  if(log.lh.n == 0 || log.outstanding > 0)
+    return 0;
+  return log.nwait > 0 || log.lh.n >= log.group || ticks - log.opened >= LOGDELAY;
+}
+
+// Copy the blocks of the transaction closed into region r into
+// log buffers, before the next transaction can change them.
+static void
+snapshot(struct logregion *r)
+{
+  for (int i = 0; i < r->lh.n; i++) {
+    r->copy[i] = bgrab(log.dev, r->start+log.nhdr+i); // log block
+    r->home[i] = bread(log.dev, r->lh.block[i]); // cache block
+    memmove(r->copy[i]->data, r->home[i]->data, BSIZE);
+    brelse(r->home[i]);
   }
 }
 
-// Copy modified blocks from cache to log.
+// Write the header and the log buffers to region r. The header
+// blocks come right before the data blocks, so all of them go to
+// the disk in runs of consecutive blocks, LOGBATCH at a time.
+// When the last write finishes, the transaction is committed.
 static void
-write_log(void)
+write_log(struct logregion *r)
 {
-  int tail;
+  // only the writer thread gets here; keep these off its stack.
+  static struct buf *hbuf[LOGHDRMAX];
+  static struct buf *all[LOGHDRMAX + MAXLOGSIZE];
+  int nhdr, nall, tail, i, n;
+  uint ck;
+
+  ck = log_seed(&r->lh);
+  for (i = 0; i < r->lh.n; i++)
+    ck = log_cksum(ck, r->lh.block[i], r->copy[i]->data);
+  r->lh.cksum = ck;
 
-  for (tail = 0; tail < log.lh.n; tail++) {
-    struct buf *to = bread(log.dev, log.start+tail+1); // log block
-    struct buf *from = bread(log.dev, log.lh.block[tail]); // cache block
-    memmove(to->data, from->data, BSIZE);
-    bwrite(to);  // write the log
-    brelse(from);
-    brelse(to);
+  nall = nhdr = fill_head(r, hbuf);
+  for (i = 0; i < nhdr; i++)
+    all[i] = hbuf[i];
+  for (i = 0; i < r->lh.n; i++)
+    all[nall++] = r->copy[i];
+
+  for (tail = 0; tail < nall; tail += n) {
+    n = nall - tail;
+    if(n > LOGBATCH)
+      n = LOGBATCH;
+    bwrite_start(all + tail, n);  // one request per batch
+    for (i = 0; i < n; i++)
+      bwrite_wait(all[tail+i]);
   }
+  for (i = 0; i < nhdr; i++)
+    brelse(hbuf[i]);
 }
 
 static void
-commit()
+commit(struct logregion *r)
 {
-  if (log.lh.n > 0) {
-    write_log();     // Write modified blocks from cache to log
-    write_head();    // Write header to disk -- the real commit
-    install_trans(0); // Now install writes to home locations
+  write_log(r);     // Write header and blocks -- the real commit
+  r->pending = 1;   // install_trans() later
+  log.ncommit++;
+  log.nblocks += r->lh.n;
+}
+
+// The log-writer thread. Closes transactions and commits them,
+// one at a time, and installs committed ones when idle or when
+// their region is needed again.
+static void
+logwriter(void)
+{
+  struct logregion *r;
+
+  acquire(&log.lock);
+  for(;;){
+    if(!closable()){
+      if(log.lh.n == 0 && (r = oldest_pending()) != 0){
+        release(&log.lock);
+        install_trans(r);
+        acquire(&log.lock);
+        continue;
+      }
+      // with blocks logged, look again at every tick.
+      log.wchan = log.lh.n > 0 ? (void*)&ticks : (void*)&log.wchan;
+      sleep(log.wchan, &log.lock);
+      log.wchan = 0;
+      continue;
+    }
+
+    // the next commit's region must be installed first; system
+    // calls carry on meanwhile.
+    r = &log.region[(log.seq + 1) % log.nregion];
+    if(r->pending){
+      release(&log.lock);
+      install_trans(r);
+      acquire(&log.lock);
+      continue;
+    }
+
+    // close the transaction.
+    log.committing = 1;
+    r->lh = log.lh;
+    r->lh.seq = ++log.seq;
+    release(&log.lock);
+    snapshot(r);
+
+    // let system calls start the next one.
+    acquire(&log.lock);
     log.lh.n = 0;
-    write_head();    // Erase the transaction from the log
+    log.committing = 0;
+    wakeup(&log);
+    release(&log.lock);
+
+    commit(r);
+    acquire(&log.lock);
   }
 }
 
 // Caller has modified b->data and is done with the buffer.
 // Record the block number and pin in the cache by increasing refcnt.
-// commit()/write_log() will do the disk write.
+// The log-writer will do the disk write.
 //
 // log_write() replaces bwrite(); a typical use is:
 //   bp = bread(...)
@@ -217,7 +589,7 @@ log_write(struct buf *b)
   int i;
 
   acquire(&log.lock);
-  if (log.lh.n >= LOGSIZE || log.lh.n >= log.size - 1)
+  if (log.lh.n >= log.size)
     panic("too big a transaction");
   if (log.outstanding < 1)
     panic("log_write outside of trans");
@@ -228,9 +600,30 @@ log_write(struct buf *b)
   }
   log.lh.block[i] = b->blockno;
   if (i == log.lh.n) {  // Add new block to log?
+    if (log.lh.n == 0)
+      log.opened = ticks;
     bpin(b);
     log.lh.n++;
   }
   release(&log.lock);
 }
 
+#ifdef LAB_LOCK
+// Commit counters for the statistics device. Ticks are about
+// 1/10th second.
+int
+statslog(char *buf, int sz)
+{
+  uint t = ticks - log.started;
+
+  int n;
+
+  n = snprintf(buf, sz, "log: #commit %d #blocks %d (%d per commit) %d commits/sec\n",
+               log.ncommit, log.nblocks,
+               log.ncommit ? log.nblocks / log.ncommit : 0,
+               t ? log.ncommit * 10 / t : 0);
+  n += snprintf(buf+n, sz-n, "log: %d regions #installed %d #absorbed %d\n",
+                log.nregion, log.ninstall, log.nabsorb);
+  return n;
+}
+#endif
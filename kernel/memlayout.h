@@ -47,6 +47,9 @@
 #define KERNBASE 0x80000000L
 #define PHYSTOP (KERNBASE + 128*1024*1024)
 
+// buddy.c manages the last BUDDYPAGES pages below PHYSTOP.
+#define BUDDYBASE (PHYSTOP - (uint64)BUDDYPAGES*PGSIZE)
+
 // map the trampoline page to the highest address,
 // in both user and kernel space.
 #define TRAMPOLINE (MAXVA - PGSIZE)
@@ -2,12 +2,21 @@
 #define NCPU          8  // maximum number of CPUs
 #define NOFILE       16  // open files per process
 #define NFILE       100  // open files per system
-#define NINODE       50  // maximum number of active i-nodes
+#ifndef NINODE
+#define NINODE       50  // boot size of the inode table
+#endif
 #define NDEV         10  // maximum major device number
 #define ROOTDEV       1  // device number of file system root disk
 #define MAXARG       32  // max exec arguments
 #define MAXOPBLOCKS  10  // max # of blocks any FS op writes
-#define LOGSIZE      (MAXOPBLOCKS*3)  // max data blocks in on-disk log
-#define NBUF         (MAXOPBLOCKS*3)  // size of disk block cache
+#define LOGSIZE      (MAXOPBLOCKS*3+1)  // blocks in on-disk log, unless mkfs -l
+#define MAXLOGSIZE   250  // max data blocks in a transaction
+#ifndef NBUF
+#define NBUF         (MAXOPBLOCKS*12) // boot size of disk block cache; 4 per log block
+#endif
+#define RAWINDOW     8   // blocks of sequential read-ahead
+#define VPOLLCYCLES  50    // most timer cycles (5us) to poll for a disk request
 #define FSSIZE       1000  // size of file system in blocks
 #define MAXPATH      128   // maximum file path name
+#define BUDDYORDER    10   // largest buddy block is 2^BUDDYORDER pages
+#define BUDDYPAGES  4096   // pages at the top of RAM kept by the buddy allocator
@@ -7,18 +7,101 @@
 #include "fs.h"
 #include "sleeplock.h"
 #include "file.h"
+#include "slab.h"
 
-#define PIPESIZE 512
+// The ring is PIPEPAGES separately allocated pages rather than one
+// block, so that piperead() can hand a full page of it to a reader
+// by swapping it with the reader's own page instead of copying.
+// A page is allocated when the write end first reaches it, so a
+// pipe that never holds much data costs one page, not PIPEPAGES.
+#define PIPEPAGES 4
+#define PIPESIZE (PIPEPAGES*PGSIZE)
 
 struct pipe {
   struct spinlock lock;
-  char data[PIPESIZE];
+  char *page[PIPEPAGES]; // 0 until the write end gets there
   uint nread;     // number of bytes read
   uint nwrite;    // number of bytes written
   int readopen;   // read fd is still open
   int writeopen;  // write fd is still open
 };
 
+// struct pipe is far smaller than a page, so pipes share slabs.
+static struct kmem_cache pipecache;
+
+// statistics, updated under different pipes' locks
+static int ncopied;   // bytes copied out to readers
+static int nflipped;  // pages swapped into readers instead
+static int nspliced;  // bytes moved by splice()
+
+void
+pipeinit(void)
+{
+  kmem_cache_init(&pipecache, "pipe", sizeof(struct pipe));
+}
+
+static void
+pipefree(struct pipe *pi)
+{
+  for(int i = 0; i < PIPEPAGES; i++)
+    if(pi->page[i])
+      kfree(pi->page[i]);
+  kmem_cache_free(&pipecache, pi);
+}
+
+// Where byte off of the stream is in the ring.
+static char*
+ringaddr(struct pipe *pi, uint off)
+{
+  return pi->page[off % PIPESIZE / PGSIZE] + off % PGSIZE;
+}
+
+// Make sure the ring page at the write end exists, calling
+// kalloc() with pi->lock released. The write end may move
+// meanwhile, so look again. Returns 0 if out of memory.
+static int
+ringpage(struct pipe *pi)
+{
+  char *pg;
+  int slot;
+
+  while(pi->page[slot = pi->nwrite % PIPESIZE / PGSIZE] == 0){
+    release(&pi->lock);
+    pg = kalloc();
+    acquire(&pi->lock);
+    if(pg == 0)
+      return 0;
+    if(pi->page[slot] == 0)
+      pi->page[slot] = pg;
+    else
+      kfree(pg);
+  }
+  return 1;
+}
+
+// How many of n bytes fit at the write end in one chunk: no more
+// than there is room for, nor past the end of the ring's page.
+static int
+wspan(struct pipe *pi, int n)
+{
+  int m = PIPESIZE - (pi->nwrite - pi->nread);
+
+  if(m > PGSIZE - pi->nwrite % PGSIZE)
+    m = PGSIZE - pi->nwrite % PGSIZE;
+  return m < n ? m : n;
+}
+
+// Likewise, how many of n bytes can be read in one chunk.
+static int
+rspan(struct pipe *pi, int n)
+{
+  int m = pi->nwrite - pi->nread;
+
+  if(m > PGSIZE - pi->nread % PGSIZE)
+    m = PGSIZE - pi->nread % PGSIZE;
+  return m < n ? m : n;
+}
+
 int
 pipealloc(struct file **f0, struct file **f1)
 {
@@ -28,8 +111,9 @@ pipealloc(struct file **f0, struct file **f1)
   *f0 = *f1 = 0;
   if((*f0 = filealloc()) == 0 || (*f1 = filealloc()) == 0)
     goto bad;
-  if((pi = (struct pipe*)kalloc()) == 0)
+  if((pi = (struct pipe*)kmem_cache_alloc(&pipecache)) == 0)
     goto bad;
+  memset(pi->page, 0, sizeof(pi->page));
   pi->readopen = 1;
   pi->writeopen = 1;
   pi->nwrite = 0;
@@ -47,7 +131,7 @@ pipealloc(struct file **f0, struct file **f1)
 
  bad:
   if(pi)
-    kfree((char*)pi);
+    pipefree(pi);
   if(*f0)
     fileclose(*f0);
   if(*f1)
@@ -71,15 +155,17 @@ pipeclose(struct pipe *pi, int writable)
 #ifdef LAB_LOCK
     freelock(&pi->lock);
 #endif    
-    kfree((char*)pi);
+    pipefree(pi);
   } else
     release(&pi->lock);
 }
 
+// Copy in as much as fits, a chunk at a time: each chunk ends
+// where the ring's page does.
 int
 pipewrite(struct pipe *pi, uint64 addr, int n)
 {
-  int i = 0;
+  int i = 0, m;
   struct proc *pr = myproc();
 
   acquire(&pi->lock);
@@ -91,12 +177,13 @@ pipewrite(struct pipe *pi, uint64 addr, int n)
     if(pi->nwrite == pi->nread + PIPESIZE){ //DOC: pipewrite-full
       wakeup(&pi->nread);
       sleep(&pi->nwrite, &pi->lock);
-    } else {
-      char ch;
-      if(copyin(pr->pagetable, &ch, addr + i, 1) == -1)
+    } else if(ringpage(pi) == 0){
+      break;
+    } else if((m = wspan(pi, n - i)) > 0){
+      if(copyin(pr->pagetable, ringaddr(pi, pi->nwrite), addr + i, m) == -1)
         break;
-      pi->data[pi->nwrite++ % PIPESIZE] = ch;
-      i++;
+      pi->nwrite += m;
+      i += m;
     }
   }
   wakeup(&pi->nread);
@@ -105,12 +192,15 @@ pipewrite(struct pipe *pi, uint64 addr, int n)
   return i;
 }
 
+// Copy out in chunks like pipewrite(). A whole ring page bound
+// for a page-aligned user buffer, as page-aligned writes of whole
+// pages produce, is flipped instead: the reader's page and the
+// ring's trade places, and the reader's old page becomes ring.
 int
 piperead(struct pipe *pi, uint64 addr, int n)
 {
-  int i;
+  int i, m;
   struct proc *pr = myproc();
-  char ch;
 
   acquire(&pi->lock);
   while(pi->nread == pi->nwrite && pi->writeopen){  //DOC: pipe-empty
@@ -120,14 +210,105 @@ piperead(struct pipe *pi, uint64 addr, int n)
     }
     sleep(&pi->nread, &pi->lock); //DOC: piperead-sleep
   }
-  for(i = 0; i < n; i++){  //DOC: piperead-copy
-    if(pi->nread == pi->nwrite)
+  for(i = 0; i < n && pi->nread != pi->nwrite; i += m){  //DOC: piperead-copy
+    m = rspan(pi, n - i);
+    if(m == PGSIZE && (addr + i) % PGSIZE == 0 &&
+       uvmflip(pr->pagetable, addr + i, &pi->page[pi->nread % PIPESIZE / PGSIZE]) == 0){
+      __atomic_fetch_add(&nflipped, 1, __ATOMIC_RELAXED);
+    } else {
+      if(copyout(pr->pagetable, addr + i, ringaddr(pi, pi->nread), m) == -1)
+        break;
+      __atomic_fetch_add(&ncopied, m, __ATOMIC_RELAXED);
+    }
+    pi->nread += m;
+  }
+  wakeup(&pi->nwrite);  //DOC: piperead-wakeup
+  release(&pi->lock);
+  return i;
+}
+
+// splice() support: it waits with pipewait() while it holds no
+// buffer, then moves what it can with pipewritek() or pipereadk(),
+// which don't sleep.
+
+// Wait until pi has bytes to read or, if writing, room to write,
+// and return 1. Returns 0 if reading and the write end is closed
+// with nothing left, and -1 if writing and the read end is closed,
+// or if killed.
+int
+pipewait(struct pipe *pi, int writing)
+{
+  struct proc *pr = myproc();
+  int r;
+
+  acquire(&pi->lock);
+  for(;;){
+    if(pr->killed || (writing && pi->readopen == 0)){
+      r = -1;
       break;
-    ch = pi->data[pi->nread++ % PIPESIZE];
-    if(copyout(pr->pagetable, addr + i, &ch, 1) == -1)
+    }
+    if(writing ? pi->nwrite != pi->nread + PIPESIZE : pi->nread != pi->nwrite){
+      r = 1;
       break;
+    }
+    if(!writing && pi->writeopen == 0){
+      r = 0;
+      break;
+    }
+    sleep(writing ? &pi->nwrite : &pi->nread, &pi->lock);
   }
-  wakeup(&pi->nwrite);  //DOC: piperead-wakeup
   release(&pi->lock);
+  return r;
+}
+
+// Copy up to n bytes from kernel address src into pi, as many as
+// there is room for. Returns how many, which is 0 if no ring
+// page could be allocated, or -1 if the read end is closed.
+int
+pipewritek(struct pipe *pi, char *src, int n)
+{
+  int i, m;
+
+  acquire(&pi->lock);
+  if(pi->readopen == 0){
+    release(&pi->lock);
+    return -1;
+  }
+  for(i = 0; i < n && wspan(pi, n - i) > 0 && ringpage(pi); i += m){
+    if((m = wspan(pi, n - i)) == 0)
+      break;
+    memmove(ringaddr(pi, pi->nwrite), src + i, m);
+    pi->nwrite += m;
+  }
+  wakeup(&pi->nread);
+  release(&pi->lock);
+  __atomic_fetch_add(&nspliced, i, __ATOMIC_RELAXED);
+  return i;
+}
+
+// Copy up to n bytes from pi to kernel address dst, as many as
+// there are. Returns how many.
+int
+pipereadk(struct pipe *pi, char *dst, int n)
+{
+  int i, m;
+
+  acquire(&pi->lock);
+  for(i = 0; i < n && (m = rspan(pi, n - i)) > 0; i += m){
+    memmove(dst + i, ringaddr(pi, pi->nread), m);
+    pi->nread += m;
+  }
+  wakeup(&pi->nwrite);
+  release(&pi->lock);
+  __atomic_fetch_add(&nspliced, i, __ATOMIC_RELAXED);
   return i;
 }
+
+#ifdef LAB_LOCK
+int
+statspipe(char *buf, int sz)
+{
+  return snprintf(buf, sz, "pipe: #copied %d bytes #flipped %d pages #spliced %d bytes\n",
+                  ncopied, nflipped, nspliced);
+}
+#endif
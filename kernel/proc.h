@@ -105,4 +105,6 @@ struct proc {
   struct file *ofile[NOFILE];  // Open files
   struct inode *cwd;           // Current directory
   char name[16];               // Process name (debugging)
+  void (*kfn)(void);           // if non-zero, a kernel thread running kfn
+  int logres;                  // log blocks reserved by begin_op_n()
 };
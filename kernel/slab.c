@@ -0,0 +1,207 @@
+// Slab allocator for small kernel objects.
+//
+// A kmem_cache hands out objects of one size carved from
+// kalloc() pages. Each CPU has its own list of partially used
+// slabs under its own lock, so allocations on different CPUs
+// don't contend. A slab stays on the list of the CPU that
+// created it; kmem_cache_free() on another CPU takes that
+// CPU's lock. When a slab becomes wholly free, it is kept as
+// the CPU's spare if there is none, and returned to kalloc()
+// otherwise.
+
+#include "types.h"
+#include "param.h"
+#include "memlayout.h"
+#include "spinlock.h"
+#include "riscv.h"
+#include "slab.h"
+#include "defs.h"
+
+#define SLABHDR ((sizeof(struct slab) + 7) & ~7)
+#define NCACHE 8
+
+// every cache, for the statistics device.
+// filled in at boot by kmem_cache_init().
+static struct kmem_cache *caches[NCACHE];
+static int ncache;
+
+static int slab_reclaim(int);
+
+void
+kmem_cache_init(struct kmem_cache *c, char *name, uint size)
+{
+  size = (size + 7) & ~7;
+  if(size < sizeof(void*) || size > PGSIZE - SLABHDR || ncache >= NCACHE)
+    panic("kmem_cache_init");
+  if(ncache == 0)
+    kreclaim_register(slab_reclaim);
+  caches[ncache++] = c;
+  c->name = name;
+  c->size = size;
+  c->perslab = (PGSIZE - SLABHDR) / size;
+  for(int i = 0; i < NCPU; i++){
+    initlock(&c->cpu[i].lock, "slab");
+    c->cpu[i].partial.next = &c->cpu[i].partial;
+    c->cpu[i].partial.prev = &c->cpu[i].partial;
+    c->cpu[i].empty = 0;
+    c->cpu[i].nslab = 0;
+    c->cpu[i].inuse = 0;
+  }
+}
+
+static void
+slab_push(struct slab *head, struct slab *s)
+{
+  s->next = head->next;
+  s->prev = head;
+  head->next->prev = s;
+  head->next = s;
+}
+
+static void
+slab_remove(struct slab *s)
+{
+  s->prev->next = s->next;
+  s->next->prev = s->prev;
+}
+
+// Turn a fresh page into a slab of free objects owned by cpu.
+static struct slab*
+slab_new(struct kmem_cache *c, int cpu)
+{
+  struct slab *s;
+  char *obj;
+
+  if((s = kalloc()) == 0)
+    return 0;
+  s->cache = c;
+  s->cpu = cpu;
+  s->inuse = 0;
+  s->free = 0;
+  for(int i = c->perslab - 1; i >= 0; i--){
+    obj = (char*)s + SLABHDR + i*c->size;
+    *(void**)obj = s->free;
+    s->free = obj;
+  }
+  return s;
+}
+
+// Allocate an object from c, or return 0 if out of memory.
+// The object's contents are undefined.
+void*
+kmem_cache_alloc(struct kmem_cache *c)
+{
+  struct slab *s, *fresh = 0;
+  void *obj;
+
+  push_off();
+  int cid = cpuid();
+  pop_off();
+
+  acquire(&c->cpu[cid].lock);
+  s = c->cpu[cid].partial.next;
+  if(s == &c->cpu[cid].partial){
+    if((s = c->cpu[cid].empty) != 0){
+      c->cpu[cid].empty = 0;
+    } else {
+      // don't call kalloc() with the lock held.
+      release(&c->cpu[cid].lock);
+      if((fresh = slab_new(c, cid)) == 0)
+        return 0;
+      acquire(&c->cpu[cid].lock);
+      s = fresh;
+      c->cpu[cid].nslab++;
+    }
+    slab_push(&c->cpu[cid].partial, s);
+  }
+
+  obj = s->free;
+  s->free = *(void**)obj;
+  s->inuse++;
+  c->cpu[cid].inuse++;
+  if(s->free == 0)
+    slab_remove(s);  // full; kmem_cache_free() puts it back.
+  release(&c->cpu[cid].lock);
+  return obj;
+}
+
+// Return obj, which came from kmem_cache_alloc(c), to c.
+void
+kmem_cache_free(struct kmem_cache *c, void *obj)
+{
+  struct slab *s = (struct slab*)PGROUNDDOWN((uint64)obj);
+  struct slab *spare = 0;
+  int cpu = s->cpu;
+
+  if(s->cache != c)
+    panic("kmem_cache_free");
+
+  acquire(&c->cpu[cpu].lock);
+  if(s->free == 0)
+    slab_push(&c->cpu[cpu].partial, s);
+  *(void**)obj = s->free;
+  s->free = obj;
+  s->inuse--;
+  c->cpu[cpu].inuse--;
+  if(s->inuse == 0){
+    slab_remove(s);
+    if(c->cpu[cpu].empty == 0){
+      c->cpu[cpu].empty = s;
+    } else {
+      spare = s;
+      c->cpu[cpu].nslab--;
+    }
+  }
+  release(&c->cpu[cpu].lock);
+
+  if(spare)
+    kfree(spare);
+}
+
+// Called by kalloc() under memory pressure: give the spare
+// empty slab of each CPU back, up to n pages.
+static int
+slab_reclaim(int n)
+{
+  struct kmem_cache *c;
+  struct slab *s;
+  int got = 0;
+
+  for(int k = 0; k < ncache && got < n; k++){
+    c = caches[k];
+    for(int i = 0; i < NCPU && got < n; i++){
+      acquire(&c->cpu[i].lock);
+      if((s = c->cpu[i].empty) != 0){
+        c->cpu[i].empty = 0;
+        c->cpu[i].nslab--;
+      }
+      release(&c->cpu[i].lock);
+      if(s){
+        kfree(s);
+        got++;
+      }
+    }
+  }
+  return got;
+}
+
+#ifdef LAB_LOCK
+int
+statsslab(char *buf, int sz)
+{
+  int n = 0, nslab, inuse;
+  struct kmem_cache *c;
+
+  for(int k = 0; k < ncache; k++){
+    c = caches[k];
+    nslab = inuse = 0;
+    for(int i = 0; i < NCPU; i++){
+      nslab += c->cpu[i].nslab;
+      inuse += c->cpu[i].inuse;
+    }
+    n += snprintf(buf+n, sz-n, "slab: %s: %d slabs %d/%d objects in use\n",
+                  c->name, nslab, inuse, nslab * c->perslab);
+  }
+  return n;
+}
+#endif
@@ -0,0 +1,24 @@
+// Object cache for small, fixed-size kernel structures.
+// Each slab is one kalloc() page with a struct slab header
+// followed by the objects.
+struct slab {
+  struct kmem_cache *cache;
+  struct slab *next;   // on the owning CPU's partial list
+  struct slab *prev;
+  int cpu;             // whose partial list this slab belongs to
+  int inuse;           // objects handed out
+  void *free;          // free objects, linked through their first word
+};
+
+struct kmem_cache {
+  char *name;
+  uint size;           // object size, rounded up to 8 bytes
+  int perslab;         // objects per slab
+  struct {
+    struct spinlock lock;
+    struct slab partial; // list head of slabs with free objects
+    struct slab *empty;  // one wholly free slab kept for reuse
+    int nslab;           // slabs owned by this CPU
+    int inuse;           // objects handed out from them
+  } cpu[NCPU];
+};
@@ -9,7 +9,7 @@
 #include "defs.h"
 
 #ifdef LAB_LOCK
-#define NLOCK 500
+#define NLOCK 1000
 
 static struct spinlock *locks[NLOCK];
 struct spinlock lock_locks;
@@ -190,6 +190,7 @@ int
 statslock(char *buf, int sz) {
   int n;
   int tot = 0;
+  int acq = 0;
 
   acquire(&lock_locks);
   n = snprintf(buf, sz, "--- lock kmem/bcache stats\n");
@@ -199,6 +200,7 @@ statslock(char *buf, int sz) {
     if(strncmp(locks[i]->name, "bcache", strlen("bcache")) == 0 ||
        strncmp(locks[i]->name, "kmem", strlen("kmem")) == 0) {
       tot += locks[i]->nts;
+      acq += locks[i]->n;
       n += snprint_lock(buf +n, sz-n, locks[i]);
     }
   }
@@ -219,7 +221,20 @@ statslock(char *buf, int sz) {
     last = locks[top]->nts;
   }
   n += snprintf(buf+n, sz-n, "tot= %d\n", tot);
+  n += snprintf(buf+n, sz-n, "acquire= %d\n", acq);
   release(&lock_locks);  
+
+  // allocator and cache counters go after "tot=", which kalloctest
+  // and bcachetest find as the first '=' in the output.
+  n += statskmem(buf+n, sz-n);
+  n += statsbuddy(buf+n, sz-n);
+  n += statsslab(buf+n, sz-n);
+  n += statsbcache(buf+n, sz-n);
+  n += statsvirtio(buf+n, sz-n);
+  n += statslog(buf+n, sz-n);
+  n += statsdcache(buf+n, sz-n);
+  n += statsnamei(buf+n, sz-n);
+  n += statspipe(buf+n, sz-n);
   return n;
 }
 #endif
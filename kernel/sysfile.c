@@ -78,6 +78,17 @@ sys_read(void)
   return fileread(f, p, n);
 }
 
+uint64
+sys_splice(void)
+{
+  struct file *in, *out;
+  int n;
+
+  if(argfd(0, 0, &in) < 0 || argfd(1, 0, &out) < 0 || argint(2, &n) < 0)
+    return -1;
+  return filesplice(in, out, n);
+}
+
 uint64
 sys_write(void)
 {
@@ -119,7 +130,7 @@ sys_fstat(void)
 uint64
 sys_link(void)
 {
-  char name[DIRSIZ], new[MAXPATH], old[MAXPATH];
+  char name[MAXNAME+1], new[MAXPATH], old[MAXPATH];
   struct inode *dp, *ip;
 
   if(argstr(0, old, MAXPATH) < 0 || argstr(1, new, MAXPATH) < 0)
@@ -165,34 +176,18 @@ bad:
   return -1;
 }
 
-// Is the directory dp empty except for "." and ".." ?
-static int
-isdirempty(struct inode *dp)
-{
-  int off;
-  struct dirent de;
-
-  for(off=2*sizeof(de); off<dp->size; off+=sizeof(de)){
-    if(readi(dp, 0, (uint64)&de, off, sizeof(de)) != sizeof(de))
-      panic("isdirempty: readi");
-    if(de.inum != 0)
-      return 0;
-  }
-  return 1;
-}
-
 uint64
 sys_unlink(void)
 {
   struct inode *ip, *dp;
-  struct dirent de;
-  char name[DIRSIZ], path[MAXPATH];
+  char name[MAXNAME+1], path[MAXPATH];
   uint off;
 
   if(argstr(0, path, MAXPATH) < 0)
     return -1;
 
-  begin_op();
+  // dp's entry and inode, ip's inode, and freeing ip.
+  begin_op_n(writei_nblocks(0, sizeof(struct dirent)) + iput_nblocks());
   if((dp = nameiparent(path, name)) == 0){
     end_op();
     return -1;
@@ -210,14 +205,12 @@ sys_unlink(void)
 
   if(ip->nlink < 1)
     panic("unlink: nlink < 1");
-  if(ip->type == T_DIR && !isdirempty(ip)){
+  if(ip->type == T_DIR && !dirempty(ip)){
     iunlockput(ip);
     goto bad;
   }
 
-  memset(&de, 0, sizeof(de));
-  if(writei(dp, 0, (uint64)&de, off, sizeof(de)) != sizeof(de))
-    panic("unlink: writei");
+  dirunlink(dp, name, off);
   if(ip->type == T_DIR){
     dp->nlink--;
     iupdate(dp);
@@ -238,11 +231,25 @@ bad:
   return -1;
 }
 
+// Most log blocks create() of a type inode can dirty: the new
+// inode's block, an entry added to the parent, which may grow
+// it, the first blocks of a new directory, and an iput() of an
+// inode it found or failed to link.
+static int
+createblocks(short type)
+{
+  int n = 1 + dirlink_nblocks(0);
+
+  if(type == T_DIR)
+    n += dirlink_nblocks(1) - 1;
+  return n + iput_nblocks();
+}
+
 static struct inode*
 create(char *path, short type, short major, short minor)
 {
   struct inode *ip, *dp;
-  char name[DIRSIZ];
+  char name[MAXNAME+1];
 
   if((dp = nameiparent(path, name)) == 0)
     return 0;
@@ -268,19 +275,31 @@ create(char *path, short type, short major, short minor)
   iupdate(ip);
 
   if(type == T_DIR){  // Create . and .. entries.
-    dp->nlink++;  // for ".."
-    iupdate(dp);
     // No ip->nlink++ for ".": avoid cyclic ref count.
     if(dirlink(ip, ".", ip->inum) < 0 || dirlink(ip, "..", dp->inum) < 0)
-      panic("create dots");
+      goto fail;
   }
 
+  // an indexed directory can refuse a name whose bucket is full.
   if(dirlink(dp, name, ip->inum) < 0)
-    panic("create: dirlink");
+    goto fail;
+
+  if(type == T_DIR){
+    dp->nlink++;  // for ".."
+    iupdate(dp);
+  }
 
   iunlockput(dp);
 
   return ip;
+
+fail:
+  // de-allocate ip.
+  ip->nlink = 0;
+  iupdate(ip);
+  iunlockput(ip);
+  iunlockput(dp);
+  return 0;
 }
 
 uint64
@@ -295,7 +314,10 @@ sys_open(void)
   if((n = argstr(0, path, MAXPATH)) < 0 || argint(1, &omode) < 0)
     return -1;
 
-  begin_op();
+  n = omode & O_CREATE ? createblocks(T_FILE) : iput_nblocks();
+  if(omode & O_TRUNC)
+    n += iput_nblocks();
+  begin_op_n(n);
 
   if(omode & O_CREATE){
     ip = create(path, T_FILE, 0, 0);
@@ -357,7 +379,7 @@ sys_mkdir(void)
   char path[MAXPATH];
   struct inode *ip;
 
-  begin_op();
+  begin_op_n(createblocks(T_DIR));
   if(argstr(0, path, MAXPATH) < 0 || (ip = create(path, T_DIR, 0, 0)) == 0){
     end_op();
     return -1;
@@ -374,7 +396,7 @@ sys_mknod(void)
   char path[MAXPATH];
   int major, minor;
 
-  begin_op();
+  begin_op_n(createblocks(T_DEVICE));
   if((argstr(0, path, MAXPATH)) < 0 ||
      argint(1, &major) < 0 ||
      argint(2, &minor) < 0 ||
@@ -95,3 +95,17 @@ sys_uptime(void)
   release(&tickslock);
   return xticks;
 }
+
+#ifdef LAB_LOCK
+// allocate and free n blocks of 2^order pages
+// from the buddy allocator, for kalloctest.
+uint64
+sys_buddybench(void)
+{
+  int order, n;
+
+  if(argint(0, &order) < 0 || argint(1, &n) < 0)
+    return -1;
+  return buddybench(order, n);
+}
+#endif
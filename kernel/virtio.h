@@ -45,7 +45,8 @@
 
 // this many virtio descriptors.
 // must be a power of two.
-#define NUM 8
+#define NUM 32
+#define VSEGMAX 8  // most bufs in one request
 
 // a single descriptor, from the spec.
 struct virtq_desc {
@@ -59,12 +60,14 @@ struct virtq_desc {
 
 // the (entire) avail ring, from the spec.
 struct virtq_avail {
-  uint16 flags; // always zero
+  uint16 flags; // VRING_AVAIL_F_NO_INTERRUPT or zero
   uint16 idx;   // driver will write ring[idx] next
   uint16 ring[NUM]; // descriptor numbers of chain heads
   uint16 unused;
 };
 
+#define VRING_AVAIL_F_NO_INTERRUPT 1 // driver doesn't want interrupts
+
 // one entry in the "used" ring, with which the
 // device tells the driver about completed requests.
 struct virtq_used_elem {
@@ -20,6 +20,14 @@
 // the address of virtio mmio register r.
 #define R(r) ((volatile uint32 *)(VIRTIO0 + (r)))
 
+#define NLATENCY 32
+
+// The longest virtio_disk_wait() polls for its request, in timer
+// cycles, with device interrupts turned off, before it turns them
+// back on and sleeps. It polls for twice the recent average
+// latency, and not at all if that is longer. 0 always sleeps.
+int vpoll = VPOLLCYCLES;
+
 static struct disk {
   // the virtio driver and device mostly communicate through a set of
   // structures in RAM. pages[] allocates that memory. pages[] is a
@@ -61,8 +69,11 @@ static struct disk {
   // for use when completion interrupt arrives.
   // indexed by first descriptor index of chain.
   struct {
-    struct buf *b;
+    struct buf *b[VSEGMAX]; // bufs for consecutive blocks
+    int nb;
     char status;
+    char write;
+    uint64 start; // r_time() at submission
   } info[NUM];
 
   // disk command headers.
@@ -70,7 +81,22 @@ static struct disk {
   struct virtio_blk_req ops[NUM];
   
   struct spinlock vdisk_lock;
-  
+
+  // statistics
+  int npoll;         // processes polling the used ring
+  int nintr;         // interrupts taken
+  int npolled;       // requests completed by polling instead
+  int ntimeout;      // polls that gave up and slept
+
+  int inflight;      // requests submitted and not completed
+  int maxinflight;
+  int nreq[2];       // reads, writes
+  int nblk[2];       // blocks they moved
+  // requests by latency in timer cycles: lat[w][k] counts the
+  // ones that took less than 2^k cycles.
+  int lat[2][NLATENCY];
+  uint64 avglat;     // moving average of latency, in cycles
+
 } __attribute__ ((aligned (PGSIZE))) disk;
 
 void
@@ -184,12 +210,13 @@ free_chain(int i)
   }
 }
 
-// allocate three descriptors (they need not be contiguous).
-// disk transfers always use three descriptors.
+// allocate n descriptors (they need not be contiguous).
+// disk transfers use one for the header, one per buf, and
+// one for the status.
 static int
-alloc3_desc(int *idx)
+allocn_desc(int *idx, int n)
 {
-  for(int i = 0; i < 3; i++){
+  for(int i = 0; i < n; i++){
     idx[i] = alloc_desc();
     if(idx[i] < 0){
       for(int j = 0; j < i; j++)
@@ -200,27 +227,39 @@ alloc3_desc(int *idx)
   return 0;
 }
 
+// start a disk operation on n bufs holding consecutive blocks, as
+// one request, and return without waiting. the bufs must be locked
+// and stay locked. when the device is done, virtio_disk_intr()
+// clears b->disk for each buf, wakes up sleepers on it, and then
+// calls b->iodone(b) if it is set.
 void
-virtio_disk_rw(struct buf *b, int write)
+virtio_disk_submitv(struct buf **bs, int n, int write)
 {
-  uint64 sector = b->blockno * (BSIZE / 512);
+  uint64 sector = bs[0]->blockno * (BSIZE / 512);
+
+  if(n < 1 || n > VSEGMAX)
+    panic("virtio_disk_submitv");
+  for(int i = 1; i < n; i++)
+    if(bs[i]->blockno != bs[0]->blockno + i || bs[i]->dev != bs[0]->dev)
+      panic("virtio_disk_submitv: not contiguous");
 
   acquire(&disk.vdisk_lock);
 
   // the spec's Section 5.2 says that legacy block operations use
-  // three descriptors: one for type/reserved/sector, one for the
-  // data, one for a 1-byte status result.
+  // a descriptor for type/reserved/sector, then the data, then a
+  // 1-byte status result. the data may be spread over several
+  // descriptors, one per buf here.
 
-  // allocate the three descriptors.
-  int idx[3];
+  // allocate the descriptors.
+  int idx[VSEGMAX+2];
   while(1){
-    if(alloc3_desc(idx) == 0) {
+    if(allocn_desc(idx, n+2) == 0) {
       break;
     }
     sleep(&disk.free[0], &disk.vdisk_lock);
   }
 
-  // format the three descriptors.
+  // format the descriptors.
   // qemu's virtio-blk.c reads them.
 
   struct virtio_blk_req *buf0 = &disk.ops[idx[0]];
@@ -237,24 +276,33 @@ virtio_disk_rw(struct buf *b, int write)
   disk.desc[idx[0]].flags = VRING_DESC_F_NEXT;
   disk.desc[idx[0]].next = idx[1];
 
-  disk.desc[idx[1]].addr = (uint64) b->data;
-  disk.desc[idx[1]].len = BSIZE;
-  if(write)
-    disk.desc[idx[1]].flags = 0; // device reads b->data
-  else
-    disk.desc[idx[1]].flags = VRING_DESC_F_WRITE; // device writes b->data
-  disk.desc[idx[1]].flags |= VRING_DESC_F_NEXT;
-  disk.desc[idx[1]].next = idx[2];
+  for(int i = 1; i <= n; i++){
+    disk.desc[idx[i]].addr = (uint64) bs[i-1]->data;
+    disk.desc[idx[i]].len = BSIZE;
+    if(write)
+      disk.desc[idx[i]].flags = 0; // device reads b->data
+    else
+      disk.desc[idx[i]].flags = VRING_DESC_F_WRITE; // device writes b->data
+    disk.desc[idx[i]].flags |= VRING_DESC_F_NEXT;
+    disk.desc[idx[i]].next = idx[i+1];
+  }
 
   disk.info[idx[0]].status = 0xff; // device writes 0 on success
-  disk.desc[idx[2]].addr = (uint64) &disk.info[idx[0]].status;
-  disk.desc[idx[2]].len = 1;
-  disk.desc[idx[2]].flags = VRING_DESC_F_WRITE; // device writes the status
-  disk.desc[idx[2]].next = 0;
-
-  // record struct buf for virtio_disk_intr().
-  b->disk = 1;
-  disk.info[idx[0]].b = b;
+  disk.desc[idx[n+1]].addr = (uint64) &disk.info[idx[0]].status;
+  disk.desc[idx[n+1]].len = 1;
+  disk.desc[idx[n+1]].flags = VRING_DESC_F_WRITE; // device writes the status
+  disk.desc[idx[n+1]].next = 0;
+
+  // record struct bufs for virtio_disk_intr().
+  for(int i = 0; i < n; i++){
+    bs[i]->disk = 1;
+    disk.info[idx[0]].b[i] = bs[i];
+  }
+  disk.info[idx[0]].nb = n;
+  disk.info[idx[0]].write = write;
+  disk.info[idx[0]].start = r_time();
+  if(++disk.inflight > disk.maxinflight)
+    disk.maxinflight = disk.inflight;
 
   // tell the device the first index in our chain of descriptors.
   disk.avail->ring[disk.avail->idx % NUM] = idx[0];
@@ -268,21 +316,147 @@ virtio_disk_rw(struct buf *b, int write)
 
   *R(VIRTIO_MMIO_QUEUE_NOTIFY) = 0; // value is queue number
 
-  // Wait for virtio_disk_intr() to say request has finished.
+  release(&disk.vdisk_lock);
+}
+
+// start a disk operation on b alone.
+void
+virtio_disk_submit(struct buf *b, int write)
+{
+  virtio_disk_submitv(&b, 1, write);
+}
+
+static int reap(struct buf **done, int *ndone);
+
+// call the completion callbacks reap() collected.
+static void
+finish(struct buf **done, int ndone)
+{
+  for(int i = 0; i < ndone; i++)
+    done[i]->iodone(done[i]);
+}
+
+// wait for the request virtio_disk_submit() started on b.
+// disk requests often finish in a few microseconds, so if they
+// have lately, first poll the used ring with the device's
+// interrupts suppressed, and only then sleep.
+void
+virtio_disk_wait(struct buf *b)
+{
+  struct buf *done[NUM];
+  int ndone;
+  uint64 t0, budget;
+
+  budget = 2 * __atomic_load_n(&disk.avglat, __ATOMIC_RELAXED);
+  if(budget > 0 && budget <= vpoll){
+    acquire(&disk.vdisk_lock);
+    if(disk.npoll++ == 0)
+      disk.avail->flags |= VRING_AVAIL_F_NO_INTERRUPT;
+    release(&disk.vdisk_lock);
+
+    t0 = r_time();
+    while(__atomic_load_n(&b->disk, __ATOMIC_ACQUIRE) == 1 && r_time() - t0 < budget){
+      if(__atomic_load_n(&disk.used->idx, __ATOMIC_ACQUIRE) == disk.used_idx)
+        continue;
+      ndone = 0;
+      acquire(&disk.vdisk_lock);
+      disk.npolled += reap(done, &ndone);
+      release(&disk.vdisk_lock);
+      finish(done, ndone);
+    }
+
+    // turn interrupts back on, then look at the used ring once
+    // more for completions that came in while they were off.
+    ndone = 0;
+    acquire(&disk.vdisk_lock);
+    if(--disk.npoll == 0)
+      disk.avail->flags &= ~VRING_AVAIL_F_NO_INTERRUPT;
+    __sync_synchronize();
+    disk.npolled += reap(done, &ndone);
+    if(b->disk == 1)
+      disk.ntimeout++;
+    release(&disk.vdisk_lock);
+    finish(done, ndone);
+  }
+
+  acquire(&disk.vdisk_lock);
   while(b->disk == 1) {
     sleep(b, &disk.vdisk_lock);
   }
+  release(&disk.vdisk_lock);
+}
 
-  disk.info[idx[0]].b = 0;
-  free_chain(idx[0]);
+void
+virtio_disk_rw(struct buf *b, int write)
+{
+  virtio_disk_submit(b, write);
+  virtio_disk_wait(b);
+}
 
-  release(&disk.vdisk_lock);
+// account for a request of nb blocks that took t cycles.
+static void
+latency(int write, int nb, uint64 t)
+{
+  int k = 0;
+
+  while(k < NLATENCY-1 && (1L << k) <= t)
+    k++;
+  disk.nreq[write]++;
+  disk.nblk[write] += nb;
+  disk.lat[write][k]++;
+  __atomic_store_n(&disk.avglat, (7*disk.avglat + t) / 8, __ATOMIC_RELAXED);
+}
+
+// process the completed requests in the used ring, with
+// disk.vdisk_lock held. wakes up waiters, and adds bufs with a
+// completion callback to done[], for the caller to pass to
+// finish() once it has released the lock.
+// returns the number of requests completed.
+static int
+reap(struct buf **done, int *ndone)
+{
+  int nb, nreq = 0;
+
+  // the device increments disk.used->idx when it
+  // adds an entry to the used ring.
+
+  while(disk.used_idx != disk.used->idx){
+    __sync_synchronize();
+    int id = disk.used->ring[disk.used_idx % NUM].id;
+
+    if(disk.info[id].status != 0)
+      panic("virtio_disk_intr status");
+
+    nb = disk.info[id].nb;
+    latency(disk.info[id].write, nb, r_time() - disk.info[id].start);
+    disk.inflight--;
+    disk.info[id].nb = 0;
+    free_chain(id);
+
+    for(int i = 0; i < nb; i++){
+      struct buf *b = disk.info[id].b[i];
+      disk.info[id].b[i] = 0;
+      __atomic_store_n(&b->disk, 0, __ATOMIC_RELEASE); // disk is done with buf
+      if(b->iodone)
+        done[(*ndone)++] = b;
+      else
+        wakeup(b);
+    }
+
+    disk.used_idx += 1;
+    nreq++;
+  }
+  return nreq;
 }
 
 void
 virtio_disk_intr()
 {
+  struct buf *done[NUM];
+  int ndone = 0;
+
   acquire(&disk.vdisk_lock);
+  disk.nintr++;
 
   // the device won't raise another interrupt until we tell it
   // we've seen this interrupt, which the following line does.
@@ -294,22 +468,34 @@ virtio_disk_intr()
 
   __sync_synchronize();
 
-  // the device increments disk.used->idx when it
-  // adds an entry to the used ring.
+  reap(done, &ndone);
 
-  while(disk.used_idx != disk.used->idx){
-    __sync_synchronize();
-    int id = disk.used->ring[disk.used_idx % NUM].id;
+  release(&disk.vdisk_lock);
 
-    if(disk.info[id].status != 0)
-      panic("virtio_disk_intr status");
+  // completion callbacks may take other locks, so call them
+  // without ours.
+  finish(done, ndone);
+}
 
-    struct buf *b = disk.info[id].b;
-    b->disk = 0;   // disk is done with buf
-    wakeup(b);
+#ifdef LAB_LOCK
+// request counts and latency histograms for the statistics device.
+int
+statsvirtio(char *buf, int sz)
+{
+  int n;
 
-    disk.used_idx += 1;
+  acquire(&disk.vdisk_lock);
+  n = snprintf(buf, sz, "virtio: #read %d (%d blocks) #write %d (%d blocks) max in flight %d\n",
+               disk.nreq[0], disk.nblk[0], disk.nreq[1], disk.nblk[1], disk.maxinflight);
+  n += snprintf(buf+n, sz-n, "virtio: #intr %d #polled %d (interrupts avoided) #poll timeout %d\n",
+                disk.nintr, disk.npolled, disk.ntimeout);
+  for(int k = 0; k < NLATENCY; k++){
+    if(disk.lat[0][k] == 0 && disk.lat[1][k] == 0)
+      continue;
+    n += snprintf(buf+n, sz-n, "virtio: latency < 2^%d cycles: read %d write %d\n",
+                  k, disk.lat[0][k], disk.lat[1][k]);
   }
-
   release(&disk.vdisk_lock);
+  return n;
 }
+#endif
@@ -23,6 +23,8 @@
 int nbitmap = FSSIZE/(BSIZE*8) + 1;
 int ninodeblocks = NINODES / IPB + 1;
 int nlog = LOGSIZE;
+int extents;  // -e: map file blocks with extents
+int hdirs;    // -d: index directories by name hash
 int nmeta;    // Number of meta blocks (boot, sb, nlog, inode, bitmap)
 int nblocks;  // Number of data blocks
 
@@ -39,7 +41,10 @@ void winode(uint, struct dinode*);
 void rinode(uint inum, struct dinode *ip);
 void rsect(uint sec, void *buf);
 uint ialloc(ushort type);
+uint ebmap(struct dinode *din, uint fbn);
 void iappend(uint inum, void *p, int n);
+void rootlink(uint rootino, char *name, uint inum);
+void hdirwrite(uint inum);
 void die(const char *);
 
 // convert to intel byte order
@@ -70,20 +75,49 @@ main(int argc, char *argv[])
 {
   int i, cc, fd;
   uint rootino, inum, off;
-  struct dirent de;
   char buf[BSIZE];
   struct dinode din;
 
 
   static_assert(sizeof(int) == 4, "Integers must be 4 bytes!");
 
+  // options
+  while(argc > 2 && argv[1][0] == '-'){
+    if(strcmp(argv[1], "-l") == 0 && argc > 3){
+      nlog = atoi(argv[2]);
+      argc -= 2;
+      argv += 2;
+    } else if(strcmp(argv[1], "-e") == 0){
+      extents = 1;
+      argc--;
+      argv++;
+    } else if(strcmp(argv[1], "-d") == 0){
+      hdirs = 1;
+      argc--;
+      argv++;
+    } else {
+      argc = 0;
+      break;
+    }
+  }
+
   if(argc < 2){
-    fprintf(stderr, "Usage: mkfs fs.img files...\n");
+    fprintf(stderr, "Usage: mkfs [-d] [-e] [-l nlog] fs.img files...\n");
+    exit(1);
+  }
+  // the log needs a header block and room for one full system
+  // call, or the kernel's initlog() panics.
+  if(nlog < 1+MAXOPBLOCKS || nlog > FSSIZE/2){
+    fprintf(stderr, "mkfs: bad log size %d (need %d to %d blocks)\n",
+            nlog, 1+MAXOPBLOCKS, FSSIZE/2);
+    fprintf(stderr, "Usage: mkfs [-d] [-e] [-l nlog] fs.img files...\n");
     exit(1);
   }
 
   assert((BSIZE % sizeof(struct dinode)) == 0);
   assert((BSIZE % sizeof(struct dirent)) == 0);
+  assert(sizeof(struct hdirindex) <= BSIZE);
+  assert(sizeof(struct hdirblk) == BSIZE);
 
   fsfd = open(argv[1], O_RDWR|O_CREAT|O_TRUNC, 0666);
   if(fsfd < 0)
@@ -101,6 +135,10 @@ main(int argc, char *argv[])
   sb.logstart = xint(2);
   sb.inodestart = xint(2+nlog);
   sb.bmapstart = xint(2+nlog+ninodeblocks);
+  // split the log in two if each half, less a header block,
+  // still holds three full system calls.
+  sb.flags = xint((extents ? FS_EXTENT : 0) | (hdirs ? FS_HDIR : 0) |
+                  (nlog >= 2*(1+3*MAXOPBLOCKS) ? FS_LOG2 : 0));
 
   printf("nmeta %d (boot, super, log blocks %u inode blocks %u, bitmap blocks %u) blocks %d total %d\n",
          nmeta, nlog, ninodeblocks, nbitmap, nblocks, FSSIZE);
@@ -117,15 +155,8 @@ main(int argc, char *argv[])
   rootino = ialloc(T_DIR);
   assert(rootino == ROOTINO);
 
-  bzero(&de, sizeof(de));
-  de.inum = xshort(rootino);
-  strcpy(de.name, ".");
-  iappend(rootino, &de, sizeof(de));
-
-  bzero(&de, sizeof(de));
-  de.inum = xshort(rootino);
-  strcpy(de.name, "..");
-  iappend(rootino, &de, sizeof(de));
+  rootlink(rootino, ".", rootino);
+  rootlink(rootino, "..", rootino);
 
   for(i = 2; i < argc; i++){
     // get rid of "user/"
@@ -149,10 +180,7 @@ main(int argc, char *argv[])
 
     inum = ialloc(T_FILE);
 
-    bzero(&de, sizeof(de));
-    de.inum = xshort(inum);
-    strncpy(de.name, shortname, DIRSIZ);
-    iappend(rootino, &de, sizeof(de));
+    rootlink(rootino, shortname, inum);
 
     while((cc = read(fd, buf, sizeof(buf))) > 0)
       iappend(inum, buf, cc);
@@ -160,18 +188,99 @@ main(int argc, char *argv[])
     close(fd);
   }
 
-  // fix size of root inode dir
-  rinode(rootino, &din);
-  off = xint(din.size);
-  off = ((off/BSIZE) + 1) * BSIZE;
-  din.size = xint(off);
-  winode(rootino, &din);
+  if(hdirs){
+    hdirwrite(rootino);
+  } else {
+    // fix size of root inode dir
+    rinode(rootino, &din);
+    off = xint(din.size);
+    off = ((off/BSIZE) + 1) * BSIZE;
+    din.size = xint(off);
+    winode(rootino, &din);
+  }
 
   balloc(freeblock);
 
   exit(0);
 }
 
+// With -d, the root directory's entries, kept until hdirwrite().
+struct hdirent hents[NINODES];
+int nhents;
+
+void
+rootlink(uint rootino, char *name, uint inum)
+{
+  struct dirent de;
+
+  if(hdirs){
+    assert(nhents < NINODES);
+    hents[nhents].inum = xshort(inum);
+    strncpy(hents[nhents].name, name, HDIRSIZ);
+    nhents++;
+    return;
+  }
+  bzero(&de, sizeof(de));
+  de.inum = xshort(inum);
+  strncpy(de.name, name, DIRSIZ);
+  iappend(rootino, &de, sizeof(de));
+}
+
+// Must match hdirhash() in kernel/fs.c.
+uint
+hdirhash(char *name)
+{
+  uint h = 2166136261;
+
+  for(int i = 0; i < HDIRSIZ && name[i]; i++)
+    h = (h ^ (uchar)name[i]) * 16777619;
+  return h;
+}
+
+// Write the -d root directory: an index of depth d and 2^d
+// buckets, for the smallest d at which every bucket fits.
+void
+hdirwrite(uint inum)
+{
+  struct hdirindex x;
+  struct hdirblk blk;
+  char buf[BSIZE];
+  int cnt[1 << HDIRMAXDEPTH];
+  uint d, mask, i, k;
+  int j, full;
+
+  for(d = 0; ; d++){
+    assert(d <= HDIRMAXDEPTH);
+    mask = (1 << d) - 1;
+    bzero(cnt, sizeof(cnt));
+    full = 0;
+    for(j = 0; j < nhents; j++)
+      if(++cnt[hdirhash(hents[j].name) & mask] > HDPB)
+        full = 1;
+    if(!full)
+      break;
+  }
+
+  bzero(&x, sizeof(x));
+  x.magic = xint(HDIRMAGIC);
+  x.depth = xint(d);
+  for(i = 0; i <= mask; i++)
+    x.bucket[i] = xint(1 + i);
+  bzero(buf, sizeof(buf));
+  memmove(buf, &x, sizeof(x));
+  iappend(inum, buf, sizeof(buf));
+
+  for(i = 0; i <= mask; i++){
+    bzero(&blk, sizeof(blk));
+    blk.depth = xint(d);
+    k = 0;
+    for(j = 0; j < nhents; j++)
+      if((hdirhash(hents[j].name) & mask) == i)
+        blk.e[k++] = hents[j];
+    iappend(inum, &blk, sizeof(blk));
+  }
+}
+
 void
 wsect(uint sec, void *buf)
 {
@@ -264,8 +373,10 @@ iappend(uint inum, void *xp, int n)
   // printf("append inum %d at off %d sz %d\n", inum, off, n);
   while(n > 0){
     fbn = off / BSIZE;
-    assert(fbn < MAXFILE);
-    if(fbn < NDIRECT){
+    assert(fbn < (extents ? MAXEXTFILE : MAXFILE));
+    if(extents){
+      x = ebmap(&din, fbn);
+    } else if(fbn < NDIRECT){
       if(xint(din.addrs[fbn]) == 0){
         din.addrs[fbn] = xint(freeblock++);
       }
@@ -293,6 +404,32 @@ iappend(uint inum, void *xp, int n)
   winode(inum, &din);
 }
 
+// With -e, the block holding file block fbn of din, allocating
+// it if fbn is just past the end. Files are written one after
+// another, so each one's blocks mostly form a single extent.
+uint
+ebmap(struct dinode *din, uint fbn)
+{
+  struct extent *e = (struct extent*)din->addrs;
+  uint off = 0;
+  int i;
+
+  for(i = 0; i < NIEXTENT && e[i].len; i++){
+    if(fbn < off + xint(e[i].len))
+      return xint(e[i].start) + fbn - off;
+    off += xint(e[i].len);
+  }
+  assert(fbn == off);
+  if(i > 0 && xint(e[i-1].start) + xint(e[i-1].len) == freeblock){
+    e[i-1].len = xint(xint(e[i-1].len) + 1);
+  } else {
+    assert(i < NIEXTENT);
+    e[i].start = xint(freeblock);
+    e[i].len = xint(1);
+  }
+  return freeblock++;
+}
+
 void
 die(const char *s)
 {
@@ -9,7 +9,7 @@
 void test0();
 void test1();
 
-#define SZ 4096
+#define SZ 8192
 char buf[SZ];
 
 int
@@ -65,21 +65,42 @@ readfile(char *file, int nbytes, int inc)
   close(fd);
 }
 
+int nacq; // #acquire() on kmem/bcache locks, set by ntas()
+
 int ntas(int print)
 {
   int n;
   char *c;
 
-  if (statistics(buf, SZ) <= 0) {
+  if ((n = statistics(buf, SZ-1)) <= 0) {
     fprintf(2, "ntas: no stats\n");
+    n = 0;
   }
+  buf[n] = '\0';
   c = strchr(buf, '=');
   n = atoi(c+2);
+  c = strchr(c+1, '=');
+  nacq = c ? atoi(c+2) : 0;
   if(print)
     printf("%s", buf);
   return n;
 }
 
+// print the buffer cache's hit/miss counters
+void
+bcachestats(void)
+{
+  char *c, *nl;
+
+  ntas(0);
+  for(c = buf; c && *c; c = nl){
+    if((nl = strchr(c, '\n')) != 0)
+      *nl++ = '\0';
+    if(memcmp(c, "bcache:", 7) == 0)
+      printf("%s\n", c);
+  }
+}
+
 void
 test0()
 {
@@ -183,5 +204,6 @@ void test1()
   for(int i = 0; i < NCHILD; i++){
     wait(0);
   }
+  bcachestats();
   printf("test1 OK\n");
 }
@@ -8,30 +8,43 @@
 
 #define NCHILD 2
 #define N 100000
-#define SZ 4096
+#define SZ 8192
+
+#define NBLK 64
 
 void test1(void);
 void test2(void);
+void test3(void);
 char buf[SZ];
 
 int
 main(int argc, char *argv[])
 {
+  if(argc > 1 && strcmp(argv[1], "buddy") == 0){
+    test3();
+    exit(0);
+  }
   test1();
   test2();
   exit(0);
 }
 
+int nacq; // #acquire() on kmem/bcache locks, set by ntas()
+
 int ntas(int print)
 {
   int n;
   char *c;
 
-  if (statistics(buf, SZ) <= 0) {
+  if ((n = statistics(buf, SZ-1)) <= 0) {
     fprintf(2, "ntas: no stats\n");
+    n = 0;
   }
+  buf[n] = '\0';
   c = strchr(buf, '=');
   n = atoi(c+2);
+  c = strchr(c+1, '=');
+  nacq = c ? atoi(c+2) : 0;
   if(print)
     printf("%s", buf);
   return n;
@@ -40,9 +53,10 @@ int ntas(int print)
 void test1(void)
 {
   void *a, *a1;
-  int n, m;
+  int n, m, acq;
   printf("start test1\n");  
   m = ntas(0);
+  acq = nacq;
   for(int i = 0; i < NCHILD; i++){
     int pid = fork();
     if(pid < 0){
@@ -68,6 +82,7 @@ void test1(void)
   }
   printf("test1 results:\n");
   n = ntas(1);
+  printf("test1 #acquire() %d\n", nacq - acq);
   if(n-m < 10) 
     printf("test1 OK\n");
   else
@@ -119,3 +134,57 @@ void test2() {
 }
 
 
+
+// print the buddy allocator's lines from the statistics device.
+void
+buddystats(void)
+{
+  char *c, *nl;
+
+  ntas(0);
+  for(c = buf; c && *c; c = nl){
+    if((nl = strchr(c, '\n')) != 0)
+      *nl++ = '\0';
+    if(memcmp(c, "buddy", 5) == 0)
+      printf("%s\n", c);
+  }
+}
+
+// allocate NBLK blocks of each order from the buddy allocator,
+// first with memory idle and then while this process holds
+// nearly every free page, and again after it gives them back.
+void
+buddyrun(char *what)
+{
+  int n;
+
+  printf("%s:\n", what);
+  for(int order = 0; order <= BUDDYORDER; order++){
+    n = buddybench(order, NBLK);
+    printf("order %d: %d/%d blocks\n", order, n, NBLK);
+  }
+  buddystats();
+}
+
+void test3(void)
+{
+  uint64 sz0 = (uint64)sbrk(0);
+  int n = 0;
+
+  printf("start test3\n");
+  buddyrun("idle");
+
+  // hold all but 64 free pages, scattering the pages kalloc()
+  // takes from the buddy region once its own lists run dry.
+  while((uint64)sbrk(4096) != 0xffffffffffffffff){
+    *(char *)(sbrk(0) - 1) = 1;
+    n++;
+  }
+  sbrk(-64*4096);
+  printf("holding %d pages\n", n - 64);
+  buddyrun("under pressure");
+
+  sbrk(-((uint64)sbrk(0) - sz0));
+  buddyrun("after release");
+  printf("test3 OK\n");
+}
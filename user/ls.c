@@ -22,11 +22,28 @@ fmtname(char *path)
   return buf;
 }
 
+// Print the entry name of the directory whose path prefix is
+// in buf, up to p.
+void
+lsent(char *buf, char *p, char *name, int n)
+{
+  struct stat st;
+
+  memmove(p, name, n);
+  p[n] = 0;
+  if(stat(buf, &st) < 0){
+    printf("ls: cannot stat %s\n", buf);
+    return;
+  }
+  printf("%s %d %d %d\n", fmtname(buf), st.type, st.ino, st.size);
+}
+
 void
 ls(char *path)
 {
+  static struct hdirblk blk;
   char buf[512], *p;
-  int fd;
+  int fd, i;
   struct dirent de;
   struct stat st;
 
@@ -47,24 +64,28 @@ ls(char *path)
     break;
 
   case T_DIR:
-    if(strlen(path) + 1 + DIRSIZ + 1 > sizeof buf){
+    if(strlen(path) + 1 + MAXNAME + 1 > sizeof buf){
       printf("ls: path too long\n");
       break;
     }
     strcpy(buf, path);
     p = buf+strlen(buf);
     *p++ = '/';
-    while(read(fd, &de, sizeof(de)) == sizeof(de)){
-      if(de.inum == 0)
-        continue;
-      memmove(p, de.name, DIRSIZ);
-      p[DIRSIZ] = 0;
-      if(stat(buf, &st) < 0){
-        printf("ls: cannot stat %s\n", buf);
-        continue;
-      }
-      printf("%s %d %d %d\n", fmtname(buf), st.type, st.ino, st.size);
+    if(read(fd, &de, sizeof(de)) != sizeof(de))
+      break;
+    if(*(uint*)&de == HDIRMAGIC){
+      // indexed (mkfs -d): skip the index, list the buckets.
+      read(fd, &blk, BSIZE - sizeof(de));
+      while(read(fd, &blk, sizeof(blk)) == sizeof(blk))
+        for(i = 0; i < HDPB; i++)
+          if(blk.e[i].inum)
+            lsent(buf, p, blk.e[i].name, HDIRSIZ);
+      break;
     }
+    do {
+      if(de.inum)
+        lsent(buf, p, de.name, DIRSIZ);
+    } while(read(fd, &de, sizeof(de)) == sizeof(de));
     break;
   }
   close(fd);
@@ -0,0 +1,84 @@
+// Pipe throughput. A child writes NBYTES into a pipe and the
+// parent reads them back, with three kinds of buffer:
+//   small: 512-byte writes and reads
+//   copy:  page-sized buffers that are not page-aligned, which
+//          the kernel copies a ring page at a time
+//   flip:  page-aligned, page-sized buffers, whose pages piperead()
+//          can flip into the reader instead of copying
+// "stats" shows how many bytes were copied and pages flipped.
+
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "kernel/riscv.h"
+#include "user/user.h"
+
+#define NBYTES (8*1024*1024)
+
+char *wbuf, *rbuf;
+
+void
+bench(char *mode, int off, int sz)
+{
+  int fds[2], pid, n, got, ok = 1;
+  uint t0;
+  char *w = wbuf + off, *r = rbuf + off;
+
+  if(pipe(fds) < 0){
+    fprintf(2, "pipebench: pipe failed\n");
+    exit(1);
+  }
+  t0 = uptime();
+  pid = fork();
+  if(pid < 0){
+    fprintf(2, "pipebench: fork failed\n");
+    exit(1);
+  }
+  if(pid == 0){
+    close(fds[0]);
+    for(n = 0; n < NBYTES; n += sz){
+      // tag each write so the reader can tell them apart.
+      memset(w, 'a' + (n / sz) % 26, sz);
+      if(write(fds[1], w, sz) != sz){
+        fprintf(2, "pipebench: write failed\n");
+        exit(1);
+      }
+    }
+    exit(0);
+  }
+
+  close(fds[1]);
+  for(got = 0; got < NBYTES; got += n){
+    n = read(fds[0], r, sz);
+    if(n <= 0)
+      break;
+    if(r[0] != 'a' + got / sz % 26 || r[n-1] != 'a' + (got + n - 1) / sz % 26)
+      ok = 0;
+  }
+  close(fds[0]);
+  wait(0);
+  if(got != NBYTES || !ok){
+    fprintf(2, "pipebench: %s: wrong data (%d bytes)\n", mode, got);
+    exit(1);
+  }
+  printf("pipebench: %s: %d KB in %d ticks\n", mode, NBYTES / 1024, uptime() - t0);
+}
+
+int
+main(int argc, char *argv[])
+{
+  char *p;
+
+  // page-aligned buffers with a spare page to misalign them.
+  p = sbrk(5*PGSIZE);
+  if(p == (char*)-1){
+    fprintf(2, "pipebench: sbrk failed\n");
+    exit(1);
+  }
+  wbuf = (char*)PGROUNDUP((uint64)p);
+  rbuf = wbuf + 2*PGSIZE;
+
+  bench("small", 0, 512);
+  bench("copy", 8, PGSIZE);
+  bench("flip", 0, PGSIZE);
+  exit(0);
+}
@@ -24,9 +24,13 @@ int getpid(void);
 char* sbrk(int);
 int sleep(int);
 int uptime(void);
+int splice(int, int, int);
 #ifdef LAB_NET
 int connect(uint32, uint16, uint16);
 #endif
+#ifdef LAB_LOCK
+int buddybench(int order, int n);
+#endif
 #ifdef LAB_PGTBL
 int pgaccess(void *base, int len, void *mask);
 // usyscall region
@@ -1382,18 +1382,67 @@ linktest(char *s)
   }
 }
 
+// Read the entries of directory path, linear or indexed (mkfs -d),
+// into e[0..max). Returns how many, or -1.
+int
+readdirents(char *path, struct hdirent *e, int max)
+{
+  static struct hdirblk blk;
+  struct dirent de;
+  int fd, i, n = 0;
+
+  if((fd = open(path, 0)) < 0)
+    return -1;
+  if(read(fd, &de, sizeof(de)) != sizeof(de)){
+    close(fd);
+    return 0;
+  }
+  if(*(uint*)&de == HDIRMAGIC){
+    // skip the index, read the buckets.
+    read(fd, &blk, BSIZE - sizeof(de));
+    while(read(fd, &blk, sizeof(blk)) == sizeof(blk))
+      for(i = 0; i < HDPB; i++)
+        if(blk.e[i].inum && n < max)
+          e[n++] = blk.e[i];
+  } else {
+    do {
+      if(de.inum && n < max){
+        memset(&e[n], 0, sizeof(e[n]));
+        e[n].inum = de.inum;
+        memmove(e[n].name, de.name, DIRSIZ);
+        n++;
+      }
+    } while(read(fd, &de, sizeof(de)) == sizeof(de));
+  }
+  close(fd);
+  return n;
+}
+
+// The longest name a directory holds: DIRSIZ, or HDIRSIZ on a
+// file system made with mkfs -d.
+int
+namemax(void)
+{
+  uint magic = 0;
+  int fd;
+
+  if((fd = open("/", 0)) < 0)
+    return DIRSIZ;
+  read(fd, &magic, sizeof(magic));
+  close(fd);
+  return magic == HDIRMAGIC ? HDIRSIZ : DIRSIZ;
+}
+
 // test concurrent create/link/unlink of the same file
 void
 concreate(char *s)
 {
-  enum { N = 40 };
+  enum { N = 40, NENT = 256 };
   char file[3];
-  int i, pid, n, fd;
+  int i, pid, n, fd, nent, k;
   char fa[N];
-  struct {
-    ushort inum;
-    char name[DIRSIZ];
-  } de;
+  static struct hdirent ents[NENT];
+  struct hdirent *de;
 
   file[0] = 'C';
   file[2] = '\0';
@@ -1424,26 +1473,24 @@ concreate(char *s)
   }
 
   memset(fa, 0, sizeof(fa));
-  fd = open(".", 0);
+  nent = readdirents(".", ents, NENT);
   n = 0;
-  while(read(fd, &de, sizeof(de)) > 0){
-    if(de.inum == 0)
-      continue;
-    if(de.name[0] == 'C' && de.name[2] == '\0'){
-      i = de.name[1] - '0';
+  for(k = 0; k < nent; k++){
+    de = &ents[k];
+    if(de->name[0] == 'C' && de->name[2] == '\0'){
+      i = de->name[1] - '0';
       if(i < 0 || i >= sizeof(fa)){
-        printf("%s: concreate weird file %s\n", s, de.name);
+        printf("%s: concreate weird file %s\n", s, de->name);
         exit(1);
       }
       if(fa[i]){
-        printf("%s: concreate duplicate file %s\n", s, de.name);
+        printf("%s: concreate duplicate file %s\n", s, de->name);
         exit(1);
       }
       fa[i] = 1;
       n++;
     }
   }
-  close(fd);
 
   if(n != N){
     printf("%s: concreate not enough files in directory listing\n", s);
@@ -1865,50 +1912,81 @@ bigfile(char *s)
   unlink("bigfile.dat");
 }
 
+// Set p to x/y, or to x/y/z if z isn't 0.
+void
+joinpath(char *p, char *x, char *y, char *z)
+{
+  strcpy(p, x);
+  p += strlen(p);
+  *p++ = '/';
+  strcpy(p, y);
+  if(z){
+    p += strlen(p);
+    *p++ = '/';
+    strcpy(p, z);
+  }
+}
+
 void
 fourteen(char *s)
 {
-  int fd;
+  int fd, max = namemax();
+  char a[HDIRSIZ+1], b[HDIRSIZ+2], p[4*(HDIRSIZ+2)];
 
-  // DIRSIZ is 14.
+  // names of namemax() characters (DIRSIZ, 14, on a linear file
+  // system) fit; one more is truncated.
+  for(int i = 0; i <= max; i++)
+    a[i] = b[i] = '0' + (i+1) % 10;
+  a[max] = '\0';
+  b[max+1] = '\0';
 
-  if(mkdir("12345678901234") != 0){
-    printf("%s: mkdir 12345678901234 failed\n", s);
+  if(mkdir(a) != 0){
+    printf("%s: mkdir %s failed\n", s, a);
     exit(1);
   }
-  if(mkdir("12345678901234/123456789012345") != 0){
-    printf("%s: mkdir 12345678901234/123456789012345 failed\n", s);
+  joinpath(p, a, b, 0);
+  if(mkdir(p) != 0){
+    printf("%s: mkdir %s failed\n", s, p);
     exit(1);
   }
-  fd = open("123456789012345/123456789012345/123456789012345", O_CREATE);
+  joinpath(p, b, b, b);
+  fd = open(p, O_CREATE);
   if(fd < 0){
-    printf("%s: create 123456789012345/123456789012345/123456789012345 failed\n", s);
+    printf("%s: create %s failed\n", s, p);
     exit(1);
   }
   close(fd);
-  fd = open("12345678901234/12345678901234/12345678901234", 0);
+  joinpath(p, a, a, a);
+  fd = open(p, 0);
   if(fd < 0){
-    printf("%s: open 12345678901234/12345678901234/12345678901234 failed\n", s);
+    printf("%s: open %s failed\n", s, p);
     exit(1);
   }
   close(fd);
 
-  if(mkdir("12345678901234/12345678901234") == 0){
-    printf("%s: mkdir 12345678901234/12345678901234 succeeded!\n", s);
+  joinpath(p, a, a, 0);
+  if(mkdir(p) == 0){
+    printf("%s: mkdir %s succeeded!\n", s, p);
     exit(1);
   }
-  if(mkdir("123456789012345/12345678901234") == 0){
-    printf("%s: mkdir 12345678901234/123456789012345 succeeded!\n", s);
+  joinpath(p, b, a, 0);
+  if(mkdir(p) == 0){
+    printf("%s: mkdir %s succeeded!\n", s, p);
     exit(1);
   }
 
   // clean up
-  unlink("123456789012345/12345678901234");
-  unlink("12345678901234/12345678901234");
-  unlink("12345678901234/12345678901234/12345678901234");
-  unlink("123456789012345/123456789012345/123456789012345");
-  unlink("12345678901234/123456789012345");
-  unlink("12345678901234");
+  joinpath(p, b, a, 0);
+  unlink(p);
+  joinpath(p, a, a, 0);
+  unlink(p);
+  joinpath(p, a, a, a);
+  unlink(p);
+  joinpath(p, b, b, b);
+  unlink(p);
+  joinpath(p, a, b, 0);
+  unlink(p);
+  unlink(a);
 }
 
 void